@@ -15,13 +15,33 @@
  */
 
 #include <jvmti.h>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <ctime>
+#include <fstream>
 #include <map>
 #include <string>
+#include <vector>
 #include <iostream>
 
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
 #define MAX_STACK_DEPTH 1024
+#define MAX_GROUPS 64
+#define MAX_FILTERS 32
+#define METHOD_CACHE_SIZE 65536
+#define HISTOGRAM_BUCKETS 40
+#define TELEMETRY_VERSION 1
+#define DEFAULT_INTERVAL (512 * 1024)
+#define TRIGGER_POLL_PERIOD 200
 
 struct Frame {
     jlong samples;
@@ -32,6 +52,208 @@ struct Frame {
 static jvmtiEnv* jvmti = NULL;
 static jrawMonitorID tree_lock;
 static std::map<std::string, Frame> root;
+static jlong sampling_interval = DEFAULT_INTERVAL;
+
+// Maps class name prefixes to integer values; built once from agent options
+class PrefixTrie {
+  private:
+    struct Node {
+        int value;
+        std::map<char, int> next;
+    };
+
+    std::vector<Node> _nodes;
+
+  public:
+    PrefixTrie() : _nodes(1) {
+        _nodes[0].value = -1;
+    }
+
+    void add(const char* prefix, int value) {
+        int n = 0;
+        for (const char* c = prefix; *c; c++) {
+            auto it = _nodes[n].next.find(*c);
+            if (it == _nodes[n].next.end()) {
+                _nodes.push_back(Node());
+                _nodes.back().value = -1;
+                n = _nodes[n].next[*c] = (int) _nodes.size() - 1;
+            } else {
+                n = it->second;
+            }
+        }
+        _nodes[n].value = value;
+    }
+
+    // Returns the value of the longest prefix of the given name, or -1 if none matches
+    int longest(const char* name) const {
+        int n = 0;
+        int result = _nodes[0].value;
+        for (const char* c = name; *c; c++) {
+            auto it = _nodes[n].next.find(*c);
+            if (it == _nodes[n].next.end()) break;
+            n = it->second;
+            if (_nodes[n].value >= 0) result = _nodes[n].value;
+        }
+        return result;
+    }
+
+    // Returns the bitmask of values of all prefixes matching the given name
+    unsigned int match_all(const char* name) const {
+        int n = 0;
+        unsigned int result = 0;
+        for (const char* c = name; *c; c++) {
+            auto it = _nodes[n].next.find(*c);
+            if (it == _nodes[n].next.end()) break;
+            n = it->second;
+            if (_nodes[n].value >= 0) result |= 1U << _nodes[n].value;
+        }
+        return result;
+    }
+};
+
+struct MethodInfo {
+    int group;
+    unsigned int filter;
+};
+
+// Lock-free map of jmethodID to the attributes computed on first sight of the method.
+// Entries are never removed; when the table is full, attributes are recomputed every time.
+class MethodCache {
+  private:
+    struct Entry {
+        std::atomic<jmethodID> method;
+        std::atomic<unsigned int> filter;
+        std::atomic<int> group;  // 0 means not yet computed, otherwise group + 1
+    };
+
+    Entry _entries[METHOD_CACHE_SIZE];
+
+    static unsigned int hash(jmethodID method) {
+        unsigned long long h = (unsigned long long) (uintptr_t) method * 0x9e3779b97f4a7c15ULL;
+        return (unsigned int) (h >> 40);
+    }
+
+  public:
+    bool get(jmethodID method, MethodInfo* info) const {
+        for (unsigned int i = hash(method), probes = 0; probes < 16; i++, probes++) {
+            const Entry* e = &_entries[i % METHOD_CACHE_SIZE];
+            jmethodID m = e->method.load(std::memory_order_acquire);
+            if (m == method) {
+                info->group = e->group.load(std::memory_order_acquire) - 1;
+                info->filter = e->filter.load(std::memory_order_relaxed);
+                return info->group >= 0;
+            }
+            if (m == NULL) break;
+        }
+        return false;
+    }
+
+    void put(jmethodID method, const MethodInfo* info) {
+        for (unsigned int i = hash(method), probes = 0; probes < 16; i++, probes++) {
+            Entry* e = &_entries[i % METHOD_CACHE_SIZE];
+            jmethodID expected = NULL;
+            if (e->method.compare_exchange_strong(expected, method) || expected == method) {
+                // Group is stored last, since it marks the entry as complete
+                e->filter.store(info->filter, std::memory_order_relaxed);
+                e->group.store(info->group + 1, std::memory_order_release);
+                return;
+            }
+        }
+    }
+};
+
+// Package rollup mode: every frame is replaced with a group matched by class name prefix
+static bool rollup = false;
+static PrefixTrie rollup_trie;
+static std::vector<std::string> group_names;
+static std::atomic<jmethodID> group_methods[MAX_GROUPS];
+
+// Stack filters: a sample is recorded only if some frame matches an include pattern
+// (when there are any) and no frame matches an exclude pattern
+static PrefixTrie filter_trie;
+static int filter_count = 0;
+static unsigned int include_mask = 0;
+static unsigned int exclude_mask = 0;
+
+static MethodCache method_cache;
+
+// Log2 histogram of durations in nanoseconds: bucket N counts values in [2^N, 2^(N+1))
+struct Histogram {
+    std::atomic<jlong> count;
+    std::atomic<jlong> total;
+    std::atomic<jlong> max;
+    std::atomic<jlong> buckets[HISTOGRAM_BUCKETS];
+
+    void record(jlong value) {
+        int bucket = 0;
+        for (jlong v = value; v > 1 && bucket < HISTOGRAM_BUCKETS - 1; v >>= 1) {
+            bucket++;
+        }
+        buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+        count.fetch_add(1, std::memory_order_relaxed);
+        total.fetch_add(value, std::memory_order_relaxed);
+
+        jlong prev_max = max.load(std::memory_order_relaxed);
+        while (value > prev_max && !max.compare_exchange_weak(prev_max, value, std::memory_order_relaxed)) {
+            // retry
+        }
+    }
+
+    // Returns the upper bound of the bucket containing the given percentile
+    jlong percentile(double p) const {
+        jlong target = (jlong) (count.load(std::memory_order_relaxed) * p);
+        jlong seen = 0;
+        for (int i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += buckets[i].load(std::memory_order_relaxed);
+            if (seen > target) return 2LL << i;
+        }
+        return max.load(std::memory_order_relaxed);
+    }
+};
+
+// Agent self-telemetry. When `stats=file` option is given, the structure is placed
+// in a memory mapped file, so it can be read by external tools without attaching.
+struct Telemetry {
+    char magic[8];
+    jint version;
+    jint histogram_buckets;
+    std::atomic<jlong> samples;
+    std::atomic<jlong> filtered_samples;
+    std::atomic<jlong> tree_nodes;
+    std::atomic<jlong> tree_bytes;
+    std::atomic<jlong> dumps;
+    Histogram alloc_time;
+    Histogram lock_wait_time;
+    Histogram stack_trace_time;
+    Histogram dump_time;
+};
+
+static Telemetry local_telemetry;
+static Telemetry* telemetry = &local_telemetry;
+static std::string telemetry_file;  // removed at VM exit
+
+// Approximate memory used by a tree node, including red-black tree node header
+static const jlong FRAME_NODE_SIZE = sizeof(std::map<jmethodID, Frame>::value_type) + 4 * sizeof(void*);
+
+static jlong nano_time() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Records time spent in the enclosing scope
+class TimeScope {
+  private:
+    Histogram* _histogram;
+    jlong _start;
+
+  public:
+    TimeScope(Histogram* histogram) : _histogram(histogram), _start(nano_time()) {
+    }
+
+    ~TimeScope() {
+        _histogram->record(nano_time() - _start);
+    }
+};
 
 // Converts JVM internal class signature to human readable name
 static std::string decode_class_signature(char* class_sig) {
@@ -78,46 +300,402 @@ static std::string get_method_name(jmethodID method) {
     return result;
 }
 
-static void dump_tree(const std::string stack_line, const std::string& class_name, const Frame* f) {
+static int resolve_group(jmethodID method) {
+    jclass method_class;
+    char* class_sig = NULL;
+    int group = -1;
+
+    if (jvmti->GetMethodDeclaringClass(method, &method_class) == 0 &&
+        jvmti->GetClassSignature(method_class, &class_sig, NULL) == 0) {
+        // Skip leading 'L' of the class signature
+        group = rollup_trie.longest(class_sig + 1);
+    }
+
+    jvmti->Deallocate((unsigned char*) class_sig);
+    return group >= 0 ? group : (int) group_names.size() - 1;
+}
+
+static MethodInfo lookup_method(jmethodID method) {
+    MethodInfo info;
+    if (!method_cache.get(method, &info)) {
+        info.group = rollup ? resolve_group(method) : 0;
+        info.filter = filter_count > 0 ? filter_trie.match_all(get_method_name(method).c_str()) : 0;
+        method_cache.put(method, &info);
+    }
+    return info;
+}
+
+static int method_group(jmethodID method) {
+    return lookup_method(method).group;
+}
+
+// Checks include and exclude patterns against all frames of a stack trace
+static bool accept_frames(const jvmtiFrameInfo* frames, jint count) {
+    unsigned int matched = 0;
+    for (jint i = 0; i < count; i++) {
+        matched |= lookup_method(frames[i].method).filter;
+        if (matched & exclude_mask) {
+            return false;
+        }
+    }
+    return include_mask == 0 || (matched & include_mask) != 0;
+}
+
+// Each group is represented in the tree by the first method seen in this group
+static jmethodID group_method(int group, jmethodID method) {
+    jmethodID expected = NULL;
+    return group_methods[group].compare_exchange_strong(expected, method) ? method : expected;
+}
+
+// Replaces frames with their group representatives, merging adjacent frames of the same group
+static jint rollup_frames(jvmtiFrameInfo* frames, jint count) {
+    jint result = 0;
+    int last_group = -1;
+    for (jint i = 0; i < count; i++) {
+        int group = method_group(frames[i].method);
+        if (group != last_group) {
+            frames[result++].method = group_method(group, frames[i].method);
+            last_group = group;
+        }
+    }
+    return result;
+}
+
+static std::string get_frame_name(jmethodID method) {
+    return rollup ? group_names[method_group(method)] : get_method_name(method);
+}
+
+static void dump_tree(std::ostream& out, const std::string stack_line, const std::string& class_name, const Frame* f) {
     if (f->samples > 0) {
         // Output sample in 'collapsed stack traces' format understood by flamegraph.pl
-        std::cout << stack_line << class_name << "_[i] " << f->samples << std::endl;
+        out << stack_line << class_name << "_[i] " << f->samples << std::endl;
     }
     for (auto it = f->children.begin(); it != f->children.end(); ++it) {
-        dump_tree(stack_line + get_method_name(it->first) + ";", class_name, &it->second);
+        dump_tree(out, stack_line + get_frame_name(it->first) + ";", class_name, &it->second);
+    }
+}
+
+// Calibration mode: sampled allocation volume of each thread is compared
+// with the exact counter provided by com.sun.management.ThreadMXBean
+struct ThreadSamples {
+    std::string name;
+    std::atomic<jlong> samples;
+    jlong id;               // java.lang.Thread id, 0 = not resolved yet
+    jlong baseline;         // exact bytes when the thread was first seen in a snapshot
+    jlong sample_baseline;  // samples at the same moment
+    jlong exact_bytes;
+    jlong snapshot;  // the last snapshot where the thread was alive, 0 = not seen yet
+    bool dead;
+    bool ended;      // ThreadEnd has been received
+
+    ThreadSamples() : samples(0), id(0), baseline(0), sample_baseline(0), exact_bytes(0), snapshot(0),
+                      dead(false), ended(false) {
+    }
+};
+
+static jlong calibration_period = 0;
+static jrawMonitorID threads_lock;
+static std::map<jlong, ThreadSamples*> thread_samples;
+static std::vector<ThreadSamples*> unresolved_threads;  // sampled, but the thread id is not known yet
+static jmethodID thread_get_id = NULL;
+
+static ThreadSamples* find_thread_samples(jlong id) {
+    ThreadSamples*& ts = thread_samples[id];
+    if (ts == NULL) {
+        ts = new ThreadSamples();
+        ts->id = id;
     }
+    return ts;
 }
 
-static void dump_profile() {
-    for (auto it = root.begin(); it != root.end(); ++it) {
-        dump_tree("", it->first, &it->second);
+// Per-thread record is created on the first sample and then kept in the thread local storage.
+// No Java code runs here: the thread id is resolved later by the calibration thread.
+static ThreadSamples* current_thread_samples(jthread thread) {
+    ThreadSamples* ts;
+    if (jvmti->GetThreadLocalStorage(thread, (void**) &ts) == 0 && ts != NULL) {
+        return ts;
+    }
+    jvmtiThreadInfo info;
+    if (jvmti->GetThreadInfo(thread, &info) != 0) {
+        return NULL;
+    }
+
+    ts = new ThreadSamples();
+    ts->name = info.name;
+    jvmti->Deallocate((unsigned char*) info.name);
+
+    jvmti->RawMonitorEnter(threads_lock);
+    unresolved_threads.push_back(ts);
+    jvmti->RawMonitorExit(threads_lock);
+
+    jvmti->SetThreadLocalStorage(thread, ts);
+    return ts;
+}
+
+// Called from the calibration thread, where Thread.getId() can be safely invoked.
+// Records of threads that ended before their id was resolved are dropped,
+// the others stay unresolved until the next snapshot. Threads hidden from
+// GetAllThreads, like compiler threads, are never resolved.
+static void resolve_thread_ids(JNIEnv* env) {
+    std::vector<ThreadSamples*> pending;
+    jvmti->RawMonitorEnter(threads_lock);
+    pending.swap(unresolved_threads);
+    jvmti->RawMonitorExit(threads_lock);
+    if (pending.empty()) {
+        return;
+    }
+
+    jint count;
+    jthread* threads;
+    if (jvmti->GetAllThreads(&count, &threads) != 0) {
+        count = 0;
+        threads = NULL;
+    }
+
+    // Thread.getId() is called outside threads_lock, since it runs Java code
+    std::vector<std::pair<ThreadSamples*, jlong> > resolved;
+    for (jint i = 0; i < count; i++) {
+        ThreadSamples* ts;
+        if (jvmti->GetThreadLocalStorage(threads[i], (void**) &ts) == 0 && ts != NULL && ts->id == 0) {
+            jlong id = env->CallLongMethod(threads[i], thread_get_id);
+            if (env->ExceptionCheck()) {
+                env->ExceptionClear();
+            } else {
+                resolved.push_back(std::make_pair(ts, id));
+            }
+        }
+        env->DeleteLocalRef(threads[i]);
+    }
+    jvmti->Deallocate((unsigned char*) threads);
+
+    jvmti->RawMonitorEnter(threads_lock);
+    for (size_t i = 0; i < resolved.size(); i++) {
+        ThreadSamples* ts = resolved[i].first;
+        // A record created from a snapshot before the thread was sampled is replaced;
+        // the baselines are taken again at the next snapshot, when both are known
+        ThreadSamples*& slot = thread_samples[resolved[i].second];
+        delete slot;
+        ts->id = resolved[i].second;
+        slot = ts;
+    }
+
+    for (size_t i = 0; i < pending.size(); i++) {
+        if (pending[i]->id != 0) {
+            continue;
+        } else if (pending[i]->ended) {
+            delete pending[i];
+        } else {
+            unresolved_threads.push_back(pending[i]);
+        }
+    }
+    jvmti->RawMonitorExit(threads_lock);
+}
+
+static void update_exact_bytes(const jlong* ids, const jlong* bytes, jint count, jlong snapshot) {
+    jvmti->RawMonitorEnter(threads_lock);
+    for (jint i = 0; i < count; i++) {
+        if (bytes[i] < 0) continue;  // thread is no longer alive
+
+        ThreadSamples* ts = find_thread_samples(ids[i]);
+        if (ts->snapshot == 0) {
+            // Allocations made before the thread is first seen are not compared
+            ts->baseline = bytes[i];
+            ts->sample_baseline = ts->samples.load(std::memory_order_relaxed);
+        }
+        ts->exact_bytes = bytes[i] - ts->baseline;
+        ts->snapshot = snapshot;
+    }
+
+    // Thread ids are never reused: a thread seen before and missing now has terminated.
+    // Threads not seen in any snapshot yet may have started after the ids were taken.
+    for (auto it = thread_samples.begin(); it != thread_samples.end(); ++it) {
+        ThreadSamples* ts = it->second;
+        if (ts->snapshot != 0 && ts->snapshot != snapshot) {
+            ts->dead = true;
+        }
+    }
+    jvmti->RawMonitorExit(threads_lock);
+}
+
+static void JNICALL calibration_thread(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    jclass ManagementFactory = env->FindClass("java/lang/management/ManagementFactory");
+    jclass ThreadMXBean = env->FindClass("com/sun/management/ThreadMXBean");
+    if (ManagementFactory == NULL || ThreadMXBean == NULL) {
+        env->ExceptionClear();
+        std::fprintf(stderr, "heapsampler: com.sun.management.ThreadMXBean is not available\n");
+        return;
+    }
+
+    jmethodID getThreadMXBean = env->GetStaticMethodID(
+        ManagementFactory, "getThreadMXBean", "()Ljava/lang/management/ThreadMXBean;");
+    jmethodID getAllThreadIds = env->GetMethodID(ThreadMXBean, "getAllThreadIds", "()[J");
+    jmethodID getThreadAllocatedBytes = env->GetMethodID(ThreadMXBean, "getThreadAllocatedBytes", "([J)[J");
+    jobject bean = env->CallStaticObjectMethod(ManagementFactory, getThreadMXBean);
+    if (env->ExceptionCheck() || bean == NULL || !env->IsInstanceOf(bean, ThreadMXBean)) {
+        env->ExceptionClear();
+        std::fprintf(stderr, "heapsampler: thread allocated bytes are not supported\n");
+        return;
+    }
+
+    for (jlong snapshot = 1; ; snapshot++) {
+        resolve_thread_ids(env);
+
+        env->PushLocalFrame(4);
+        jlongArray ids = (jlongArray) env->CallObjectMethod(bean, getAllThreadIds);
+        jlongArray bytes = ids == NULL ? NULL :
+            (jlongArray) env->CallObjectMethod(bean, getThreadAllocatedBytes, ids);
+
+        if (env->ExceptionCheck() || bytes == NULL) {
+            env->ExceptionClear();
+        } else {
+            jint count = env->GetArrayLength(ids);
+            jlong* ids_data = env->GetLongArrayElements(ids, NULL);
+            jlong* bytes_data = env->GetLongArrayElements(bytes, NULL);
+            update_exact_bytes(ids_data, bytes_data, count, snapshot);
+            env->ReleaseLongArrayElements(bytes, bytes_data, JNI_ABORT);
+            env->ReleaseLongArrayElements(ids, ids_data, JNI_ABORT);
+        }
+        env->PopLocalFrame(NULL);
+
+        jvmti->RawMonitorEnter(threads_lock);
+        jvmti->RawMonitorWait(threads_lock, calibration_period);
+        jvmti->RawMonitorExit(threads_lock);
+    }
+}
+
+static void dump_calibration(std::ostream& out) {
+    jlong total_estimated = 0;
+    jlong total_exact = 0;
+    char buf[256];
+
+    jvmti->RawMonitorEnter(threads_lock);
+    for (auto it = thread_samples.begin(); it != thread_samples.end(); ) {
+        ThreadSamples* ts = it->second;
+        jlong estimated = (ts->samples.load(std::memory_order_relaxed) - ts->sample_baseline) * sampling_interval;
+        if (estimated != 0 || ts->exact_bytes != 0) {
+            std::snprintf(buf, sizeof(buf), "# heapsampler: thread id=%lld estimated=%lld exact=%lld ratio=%.3f%s ",
+                          (long long) it->first, (long long) estimated, (long long) ts->exact_bytes,
+                          ts->exact_bytes > 0 ? (double) estimated / ts->exact_bytes : 0.0,
+                          ts->dead ? " dead" : "");
+            out << buf << "[" << ts->name << "]" << std::endl;
+
+            total_estimated += estimated;
+            total_exact += ts->exact_bytes;
+        }
+
+        // A terminated thread is reported once, then forgotten
+        if (ts->dead) {
+            delete ts;
+            it = thread_samples.erase(it);
+        } else {
+            ++it;
+        }
+    }
+    jvmti->RawMonitorExit(threads_lock);
+
+    std::snprintf(buf, sizeof(buf), "# heapsampler: total estimated=%lld exact=%lld ratio=%.3f [all threads]",
+                  (long long) total_estimated, (long long) total_exact,
+                  total_exact > 0 ? (double) total_estimated / total_exact : 0.0);
+    out << buf << std::endl;
+}
+
+static void dump_histogram(std::ostream& out, const char* name, const Histogram* h) {
+    jlong count = h->count.load(std::memory_order_relaxed);
+    jlong avg = count > 0 ? h->total.load(std::memory_order_relaxed) / count : 0;
+    out << "# heapsampler: " << name << " count=" << count << " avg=" << avg << "ns"
+              << " p50=" << h->percentile(0.5) << "ns p99=" << h->percentile(0.99) << "ns"
+              << " max=" << h->max.load(std::memory_order_relaxed) << "ns" << std::endl;
+}
+
+// Telemetry trailer is printed as comments that do not end with a number,
+// so that flamegraph.pl skips them
+static void dump_telemetry(std::ostream& out) {
+    out << "# heapsampler: " << telemetry->samples.load() << " samples, "
+              << telemetry->filtered_samples.load() << " filtered, "
+              << telemetry->tree_nodes.load() << " tree nodes, "
+              << telemetry->tree_bytes.load() << " tree bytes, "
+              << telemetry->dumps.load() << " dumps" << std::endl;
+    dump_histogram(out, "SampledObjectAlloc", &telemetry->alloc_time);
+    dump_histogram(out, "GetStackTrace", &telemetry->stack_trace_time);
+    dump_histogram(out, "tree_lock wait", &telemetry->lock_wait_time);
+    dump_histogram(out, "dump", &telemetry->dump_time);
+}
+
+static void dump_profile(std::ostream& out) {
+    {
+        TimeScope ts(&telemetry->dump_time);
+        for (auto it = root.begin(); it != root.end(); ++it) {
+            dump_tree(out, "", it->first, &it->second);
+        }
+    }
+    telemetry->dumps.fetch_add(1, std::memory_order_relaxed);
+    dump_telemetry(out);
+
+    if (calibration_period > 0) {
+        dump_calibration(out);
     }
 }
 
 static void record_stack_trace(char* class_sig, jvmtiFrameInfo* frames, jint count, jlong size) {
+    size_t prev_size = root.size();
     Frame* f = &root[decode_class_signature(class_sig)];
+    jlong new_nodes = root.size() - prev_size;
+
     while (--count >= 0) {
-        f = &f->children[frames[count].method];
+        std::map<jmethodID, Frame>& children = f->children;
+        prev_size = children.size();
+        f = &children[frames[count].method];
+        new_nodes += children.size() - prev_size;
     }
     f->samples++;
     f->bytes += size;
+
+    if (new_nodes > 0) {
+        telemetry->tree_nodes.fetch_add(new_nodes, std::memory_order_relaxed);
+        telemetry->tree_bytes.fetch_add(new_nodes * FRAME_NODE_SIZE, std::memory_order_relaxed);
+    }
 }
 
 void JNICALL SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* env, jthread thread,
                                 jobject object, jclass object_klass, jlong size) {
+    TimeScope ts(&telemetry->alloc_time);
+    telemetry->samples.fetch_add(1, std::memory_order_relaxed);
+
+    if (calibration_period > 0) {
+        ThreadSamples* samples = current_thread_samples(thread);
+        if (samples != NULL) {
+            samples->samples.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
 
     jvmtiFrameInfo frames[MAX_STACK_DEPTH];
     jint count;
-    if (jvmti->GetStackTrace(thread, 0, MAX_STACK_DEPTH, frames, &count) != 0) {
+    jvmtiError err;
+    {
+        TimeScope ts(&telemetry->stack_trace_time);
+        err = jvmti->GetStackTrace(thread, 0, MAX_STACK_DEPTH, frames, &count);
+    }
+    if (err != 0) {
+        return;
+    }
+
+    if (filter_count > 0 && !accept_frames(frames, count)) {
+        telemetry->filtered_samples.fetch_add(1, std::memory_order_relaxed);
         return;
     }
 
+    if (rollup) {
+        count = rollup_frames(frames, count);
+    }
+
     char* class_sig;
     if (jvmti->GetClassSignature(object_klass, &class_sig, NULL) != 0) {
         return;
     }
 
+    jlong lock_start = nano_time();
     jvmti->RawMonitorEnter(tree_lock);
+    telemetry->lock_wait_time.record(nano_time() - lock_start);
     record_stack_trace(class_sig, frames, count, size);
     jvmti->RawMonitorExit(tree_lock);
 
@@ -126,35 +704,255 @@ void JNICALL SampledObjectAlloc(jvmtiEnv* jvmti, JNIEnv* env, jthread thread,
 
 void JNICALL DataDumpRequest(jvmtiEnv* jvmti) {
     jvmti->RawMonitorEnter(tree_lock);
-    dump_profile();
+    dump_profile(std::cout);
+    jvmti->RawMonitorExit(tree_lock);
+}
+
+// File-triggered dumps avoid SIGQUIT which also prints a full thread dump
+static std::string trigger_file;
+static std::string dump_dir;
+static jrawMonitorID trigger_lock;
+
+static std::string timestamped_dump_path() {
+    long long millis = std::chrono::duration_cast<std::chrono::milliseconds>(
+        std::chrono::system_clock::now().time_since_epoch()).count();
+    std::time_t now = (std::time_t) (millis / 1000);
+    std::tm tm;
+#ifdef _WIN32
+    localtime_s(&tm, &now);
+#else
+    localtime_r(&now, &tm);
+#endif
+
+    char name[64];
+    size_t len = std::strftime(name, sizeof(name), "heapsampler-%Y%m%d-%H%M%S", &tm);
+    std::snprintf(name + len, sizeof(name) - len, ".%03d.txt", (int) (millis % 1000));
+    return dump_dir + "/" + name;
+}
+
+// The dump is written to a temporary file first and then renamed,
+// so that collectors never see a partially written profile
+static void dump_to_file() {
+    std::string path = timestamped_dump_path();
+    std::string tmp_path = path + ".tmp";
+
+    std::ofstream out(tmp_path.c_str());
+    if (!out) {
+        std::fprintf(stderr, "heapsampler: cannot create %s\n", tmp_path.c_str());
+        return;
+    }
+
+    jvmti->RawMonitorEnter(tree_lock);
+    dump_profile(out);
     jvmti->RawMonitorExit(tree_lock);
+
+    out.close();
+    if (out.fail() || std::rename(tmp_path.c_str(), path.c_str()) != 0) {
+        std::fprintf(stderr, "heapsampler: cannot write %s\n", path.c_str());
+        std::remove(tmp_path.c_str());
+    }
+}
+
+static void JNICALL trigger_thread(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    jvmti->RawMonitorEnter(trigger_lock);
+    while (true) {
+        // Removing the trigger file both checks its presence and acknowledges the request
+        if (std::remove(trigger_file.c_str()) == 0) {
+            dump_to_file();
+        }
+        jvmti->RawMonitorWait(trigger_lock, TRIGGER_POLL_PERIOD);
+    }
+}
+
+static void start_agent_thread(JNIEnv* env, const char* name, jvmtiStartFunction func) {
+    jclass Thread = env->FindClass("java/lang/Thread");
+    jmethodID init = env->GetMethodID(Thread, "<init>", "(Ljava/lang/String;)V");
+    jobject thread = env->NewObject(Thread, init, env->NewStringUTF(name));
+    if (thread == NULL || jvmti->RunAgentThread(thread, func, NULL, JVMTI_THREAD_NORM_PRIORITY) != 0) {
+        env->ExceptionClear();
+        std::fprintf(stderr, "heapsampler: cannot start %s thread\n", name);
+    }
+}
+
+// Background threads require a live VM; they are started at VMInit or on attach
+static void start_agent_threads(JNIEnv* env) {
+    if (calibration_period > 0) {
+        thread_get_id = env->GetMethodID(env->FindClass("java/lang/Thread"), "getId", "()J");
+        if (thread_get_id == NULL) {
+            env->ExceptionClear();
+        } else {
+            start_agent_thread(env, "heapsampler calibration", calibration_thread);
+        }
+    }
+
+    if (!trigger_file.empty()) {
+        start_agent_thread(env, "heapsampler trigger", trigger_thread);
+    }
+}
+
+void JNICALL VMInit(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+    start_agent_threads(env);
+}
+
+// Lets the calibration thread free records of threads that ended before their id was resolved
+void JNICALL ThreadEnd(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+    ThreadSamples* ts;
+    if (jvmti->GetThreadLocalStorage(thread, (void**) &ts) == 0 && ts != NULL) {
+        jvmti->RawMonitorEnter(threads_lock);
+        ts->ended = true;
+        jvmti->RawMonitorExit(threads_lock);
+    }
 }
 
 void JNICALL VMDeath(jvmtiEnv* jvmti, JNIEnv* env) {
     DataDumpRequest(jvmti);
+    if (!telemetry_file.empty()) {
+        std::remove(telemetry_file.c_str());
+    }
+}
+
+// Parses colon separated list of package prefixes, e.g. io.netty:com.fasterxml.jackson
+static void add_rollup_groups(const char* prefixes) {
+    std::string list(prefixes);
+    for (size_t start = 0; start < list.size() && group_names.size() < MAX_GROUPS - 1; ) {
+        size_t end = list.find(':', start);
+        if (end == std::string::npos) end = list.size();
+
+        std::string prefix = list.substr(start, end - start);
+        if (!prefix.empty()) {
+            // Match against JVM internal class names
+            std::string internal_prefix(prefix);
+            for (size_t i = 0; i < internal_prefix.size(); i++) {
+                if (internal_prefix[i] == '.') internal_prefix[i] = '/';
+            }
+            rollup_trie.add(internal_prefix.c_str(), (int) group_names.size());
+            group_names.push_back(prefix);
+        }
+        start = end + 1;
+    }
+
+    // The last group collects frames that match no prefix
+    group_names.push_back("[other]");
+    rollup = true;
+}
+
+// Parses colon separated list of class or method name prefixes, e.g. ru.ok.rpc:ru.ok.db.Dao.query
+static void add_filters(const char* patterns, unsigned int* mask) {
+    std::string list(patterns);
+    for (size_t start = 0; start < list.size() && filter_count < MAX_FILTERS; ) {
+        size_t end = list.find(':', start);
+        if (end == std::string::npos) end = list.size();
+
+        if (end > start) {
+            filter_trie.add(list.substr(start, end - start).c_str(), filter_count);
+            *mask |= 1U << filter_count++;
+        }
+        start = end + 1;
+    }
+}
+
+static Telemetry* map_telemetry(const char* path) {
+#ifdef _WIN32
+    std::fprintf(stderr, "heapsampler: stats file is not supported on this platform\n");
+    return NULL;
+#else
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1) {
+        std::fprintf(stderr, "heapsampler: cannot open stats file %s\n", path);
+        return NULL;
+    }
+
+    void* addr = MAP_FAILED;
+    if (ftruncate(fd, sizeof(Telemetry)) == 0) {
+        addr = mmap(NULL, sizeof(Telemetry), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    }
+    close(fd);
+
+    if (addr == MAP_FAILED) {
+        std::fprintf(stderr, "heapsampler: cannot map stats file %s\n", path);
+        return NULL;
+    }
+    return (Telemetry*) addr;
+#endif
+}
+
+static void set_telemetry_file(const char* path) {
+    Telemetry* t = map_telemetry(path);
+    if (t != NULL) {
+        t->version = TELEMETRY_VERSION;
+        t->histogram_buckets = HISTOGRAM_BUCKETS;
+        std::memcpy(t->magic, "HSAMPLER", sizeof(t->magic));
+        telemetry = t;
+        telemetry_file = path;
+    }
+}
+
+static void parse_options(const char* options) {
+    std::string list(options);
+    for (size_t start = 0; start < list.size(); ) {
+        size_t end = list.find(',', start);
+        if (end == std::string::npos) end = list.size();
+
+        std::string opt = list.substr(start, end - start);
+        if (opt[0] >= '0' && opt[0] <= '9') {
+            sampling_interval = std::atoi(opt.c_str());
+        } else if (opt.compare(0, 9, "interval=") == 0) {
+            sampling_interval = std::atoi(opt.c_str() + 9);
+        } else if (opt.compare(0, 7, "rollup=") == 0 && !rollup) {
+            add_rollup_groups(opt.c_str() + 7);
+        } else if (opt.compare(0, 8, "include=") == 0) {
+            add_filters(opt.c_str() + 8, &include_mask);
+        } else if (opt.compare(0, 8, "exclude=") == 0) {
+            add_filters(opt.c_str() + 8, &exclude_mask);
+        } else if (opt.compare(0, 10, "calibrate=") == 0) {
+            calibration_period = std::atoi(opt.c_str() + 10);
+        } else if (opt.compare(0, 8, "trigger=") == 0) {
+            trigger_file = opt.substr(8);
+        } else if (opt.compare(0, 8, "dumpdir=") == 0) {
+            dump_dir = opt.substr(8);
+        } else if (opt.compare(0, 6, "stats=") == 0 && telemetry == &local_telemetry) {
+            set_telemetry_file(opt.c_str() + 6);
+        }
+        start = end + 1;
+    }
+
+    // By default, dumps are placed next to the trigger file
+    if (!trigger_file.empty() && dump_dir.empty()) {
+        size_t slash = trigger_file.find_last_of("/\\");
+        dump_dir = slash == std::string::npos ? "." : trigger_file.substr(0, slash);
+    }
 }
 
 JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     vm->GetEnv((void**) &jvmti, JVMTI_VERSION_1_0);
 
     jvmti->CreateRawMonitor("tree_lock", &tree_lock);
+    jvmti->CreateRawMonitor("threads_lock", &threads_lock);
+    jvmti->CreateRawMonitor("trigger_lock", &trigger_lock);
 
     jvmtiCapabilities capabilities = {0};
     capabilities.can_generate_sampled_object_alloc_events = 1;
     jvmti->AddCapabilities(&capabilities);
 
-    if (options != NULL && options[0] >= '0' && options[0] <= '9') {
-        jvmti->SetHeapSamplingInterval(std::atoi(options));
+    if (options != NULL) {
+        parse_options(options);
     }
+    jvmti->SetHeapSamplingInterval((jint) sampling_interval);
 
     jvmtiEventCallbacks callbacks = {0};
+    callbacks.VMInit = VMInit;
     callbacks.SampledObjectAlloc = SampledObjectAlloc;
     callbacks.DataDumpRequest = DataDumpRequest;
+    callbacks.ThreadEnd = ThreadEnd;
     callbacks.VMDeath = VMDeath;
     jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_SAMPLED_OBJECT_ALLOC, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
+    if (calibration_period > 0) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, NULL);
+    }
 
     return 0;
 }
@@ -164,5 +962,12 @@ JNIEXPORT jint JNICALL Agent_OnAttach(JavaVM* vm, char* options, void* reserved)
     if (jvmti != NULL) {
         return 0;
     }
-    return Agent_OnLoad(vm, options, reserved);
+
+    jint result = Agent_OnLoad(vm, options, reserved);
+
+    JNIEnv* env;
+    if (result == 0 && vm->GetEnv((void**) &env, JNI_VERSION_1_6) == 0) {
+        start_agent_threads(env);
+    }
+    return result;
 }
@@ -0,0 +1,95 @@
+/*
+ * Copyright 2019 Odnoklassniki Ltd, Mail.Ru Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Prints vmtrace counters of a running JVM from its shared counter file
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "vmtrace.h"
+
+static void print_counters(const CounterFileHeader* header, int count) {
+    const CounterEntry* entries = (const CounterEntry*) (header + 1);
+    for (int i = 0; i < count; i++) {
+        char name[COUNTER_NAME_SIZE];
+        memcpy(name, entries[i].name, sizeof(name));
+        name[sizeof(name) - 1] = 0;
+        printf("%s %lld\n", name, __atomic_load_n(&entries[i].value, __ATOMIC_RELAXED));
+    }
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: vmcounters <pid>|<file> [interval_ms]\n");
+        return 1;
+    }
+
+    char path[1024];
+    if (strspn(argv[1], "0123456789") == strlen(argv[1])) {
+        // The JVM is expected to run as the same user, as with jstat
+        char dir[512];
+        struct passwd* pw = getpwuid(geteuid());
+        if (pw != NULL) {
+            snprintf(dir, sizeof(dir), COUNTERS_DIR, pw->pw_name);
+        } else {
+            char uid[16];
+            snprintf(uid, sizeof(uid), "%u", (unsigned int) geteuid());
+            snprintf(dir, sizeof(dir), COUNTERS_DIR, uid);
+        }
+        snprintf(path, sizeof(path), "%s/%s.counters", dir, argv[1]);
+    } else {
+        snprintf(path, sizeof(path), "%s", argv[1]);
+    }
+    int interval = argc > 2 ? atoi(argv[2]) : 0;
+
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Cannot open counter file: %s\n", path);
+        return 1;
+    }
+
+    void* p = (size_t) st.st_size < sizeof(CounterFileHeader) ? MAP_FAILED
+              : mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+
+    const CounterFileHeader* header = (const CounterFileHeader*) p;
+    if (p == MAP_FAILED || memcmp(header->magic, COUNTERS_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != COUNTERS_VERSION) {
+        fprintf(stderr, "Not a vmtrace counter file: %s\n", path);
+        return 1;
+    }
+
+    int count = header->count;
+    if (count < 0 || sizeof(CounterFileHeader) + count * sizeof(CounterEntry) > (size_t) st.st_size) {
+        fprintf(stderr, "Truncated counter file: %s\n", path);
+        return 1;
+    }
+
+    print_counters(header, count);
+    while (interval > 0) {
+        usleep(interval * 1000);
+        printf("\n");
+        print_counters(header, count);
+        fflush(stdout);
+    }
+    return 0;
+}
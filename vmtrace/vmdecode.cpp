@@ -0,0 +1,146 @@
+/*
+ * Copyright 2019 Odnoklassniki Ltd, Mail.Ru Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Converts binary vmtrace log to the text format
+
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "vmtrace.h"
+
+// The agent never writes a string or report longer than its 64 KB buffer
+#define MAX_RECORD_LENGTH (1024 * 1024)
+
+static std::vector<std::string> strings;
+
+static const char* lookup_string(unsigned int id) {
+    return id > 0 && id < strings.size() ? strings[id].c_str() : "(null)";
+}
+
+static bool get_varint(FILE* in, unsigned long long* value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        int b = fgetc(in);
+        if (b == EOF) {
+            return false;
+        }
+        *value |= (unsigned long long) (b & 0x7f) << shift;
+        if ((b & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool read_string(FILE* in) {
+    unsigned long long id, len;
+    if (!get_varint(in, &id) || !get_varint(in, &len) || id >= 0x10000000 || len > MAX_RECORD_LENGTH) {
+        return false;
+    }
+
+    std::string s(len, 0);
+    if (len > 0 && fread(&s[0], 1, len, in) != len) {
+        return false;
+    }
+
+    if (id >= strings.size()) {
+        strings.resize(id + 1);
+    }
+    strings[id] = s;
+    return true;
+}
+
+static bool read_event(FILE* in, int kind, long long* time, EventRecord* r) {
+    unsigned long long value;
+    if (!get_varint(in, &value)) {
+        return false;
+    }
+    *time += zigzag_decode(value);
+
+    memset(r, 0, sizeof(EventRecord));
+    r->kind = kind;
+    r->time = *time;
+    for (int i = 0; i < EVENT_STRING_COUNT[kind]; i++) {
+        if (!get_varint(in, &value)) return false;
+        r->strings[i] = (unsigned int) value;
+    }
+    for (int i = 0; i < EVENT_ARG_COUNT[kind]; i++) {
+        if (!get_varint(in, &r->args[i])) return false;
+    }
+    return true;
+}
+
+static bool read_report(FILE* in, long long* time) {
+    unsigned long long value, len;
+    if (!get_varint(in, &value) || !get_varint(in, &len) || len > MAX_RECORD_LENGTH) {
+        return false;
+    }
+    *time += zigzag_decode(value);
+
+    std::string text(len, 0);
+    if (len > 0 && fread(&text[0], 1, len, in) != len) {
+        return false;
+    }
+
+    printf("[%.5f] %s\n", *time / 1000000000.0, text.c_str());
+    return true;
+}
+
+int main(int argc, char** argv) {
+    FILE* in = argc > 1 ? fopen(argv[1], "rb") : stdin;
+    if (in == NULL) {
+        fprintf(stderr, "Cannot open input file: %s\n", argv[1]);
+        return 1;
+    }
+
+    char header[8];
+    if (fread(header, 1, sizeof(header), in) != sizeof(header) ||
+        memcmp(header, BINARY_LOG_MAGIC, 7) != 0 || header[7] != BINARY_LOG_VERSION) {
+        fprintf(stderr, "Not a binary vmtrace log\n");
+        return 1;
+    }
+
+    long long time = 0;
+    for (int kind; (kind = fgetc(in)) != EOF; ) {
+        EventRecord r;
+        bool ok;
+        if (kind == EVENT_STRING) {
+            ok = read_string(in);
+        } else if (kind == EVENT_REPORT) {
+            ok = read_report(in, &time);
+        } else if ((ok = kind < EVENT_KIND_COUNT && read_event(in, kind, &time, &r))) {
+            char message[1024];
+            format_event(message, sizeof(message), &r, lookup_string);
+            printf("[%.5f] %s\n", r.time / 1000000000.0, message);
+        }
+
+        if (!ok) {
+            if (feof(in)) {
+                // The last record of a crashed JVM may be incomplete
+                break;
+            }
+            fprintf(stderr, "Malformed record at offset %ld\n", ftell(in));
+            return 1;
+        }
+    }
+
+    if (ferror(in)) {
+        fprintf(stderr, "Cannot read input file\n");
+        return 1;
+    }
+    return 0;
+}
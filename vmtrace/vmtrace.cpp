@@ -15,119 +15,3312 @@
  */
 
 #include <jvmti.h>
+#include <jvmticmlr.h>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
 #include <stdarg.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <time.h>
+#include "vmtrace.h"
+
+#ifdef _WIN32
+#include <chrono>
+#include <process.h>
+#define getpid _getpid
+#else
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#define HAVE_TSC
+#endif
+
+#define RING_SIZE 65536           // must be a power of 2
+#define MAX_LINE 1024
+#define STRING_TABLE_SIZE 262144  // must be a power of 2
+#define METHOD_CACHE_SIZE 131072  // must be a power of 2
+#define MAX_STRING_PROBES 64
+#define INLINE_STRING_ID STRING_TABLE_SIZE  // ids of strings carried by the event itself
+#define WRITE_BUFFER_SIZE 65536
+#define WRITER_IDLE_PERIOD 10     // ms
+#define MIN_SEGMENT_SIZE (1024 * 1024)
+#define SEGMENT_SUFFIX ".vmtrace."  // segment files are <file>.vmtrace.<N>
+#define TSC_CALIBRATION_TIME 10000000  // ns
+#define PAUSE_SUB_BUCKETS 16
+#define PAUSE_BUCKETS (PAUSE_SUB_BUCKETS * 40)
+#define CODE_HEAP_GAP (1024 * 1024)  // larger gaps are boundaries between code heap segments
+#define CLASS_PENDING_TIMEOUT 60000000000LL  // ns; a class not prepared by then is never prepared
+#define CLASS_PENDING_MIN_SCAN 1024
+#define CONTENTION_SITES 1024     // max per thread
+#define CONTENTION_INITIAL_SITES 16  // must be a power of 2
+#define CONTENTION_PROBES 8
+#define CONTENTION_FRAMES 8
+#define CONTENTION_TOP 10
+#define EXCEPTION_SITES 4096      // must be a power of 2
+#define EXCEPTION_FRAMES 8
+#define EXCEPTION_TOP 20
+#define THREAD_CPU_TOP 10
+#define WALL_FRAMES 64
+
+enum OutputFormat {
+    FORMAT_TEXT,
+    FORMAT_BINARY,
+    FORMAT_CHROME
+};
 
 static FILE* out;
+static int output_format = FORMAT_TEXT;
 static jrawMonitorID vmtrace_lock;
 static jlong start_time;
 
-static void trace(jvmtiEnv* jvmti, const char* fmt, ...) {
-    jlong current_time;
-    jvmti->GetTime(&current_time);
+// Monotonic clock in nanoseconds. Uses rdtsc scaled by a one-time calibration
+// against CLOCK_MONOTONIC when the CPU has invariant TSC, and clock_gettime otherwise.
+// Either way, the result is on the CLOCK_MONOTONIC time scale, though the TSC extrapolation
+// slowly drifts from it; timestamps matched with other tools use monotonic_time().
+class Clock {
+  private:
+    static bool _use_tsc;
+    static unsigned long long _tsc_base;
+    static jlong _ns_base;
+    static double _ns_per_tick;
+
+#ifdef HAVE_TSC
+    static bool has_invariant_tsc() {
+        unsigned int eax, ebx, ecx, edx;
+        return __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx) && (edx & (1 << 8)) != 0;
+    }
+#endif
+
+  public:
+    static jlong monotonic_time() {
+#ifdef _WIN32
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+#else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (jlong) ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+    }
+
+    static void init(bool allow_tsc) {
+#ifdef HAVE_TSC
+        if (allow_tsc && has_invariant_tsc()) {
+            // Busy wait to measure TSC frequency
+            jlong ns_start = monotonic_time();
+            unsigned long long tsc_start = __rdtsc();
+            jlong ns_end;
+            do {
+                ns_end = monotonic_time();
+            } while (ns_end - ns_start < TSC_CALIBRATION_TIME);
+            unsigned long long tsc_end = __rdtsc();
+
+            _ns_per_tick = (double) (ns_end - ns_start) / (tsc_end - tsc_start);
+            _tsc_base = tsc_end;
+            _ns_base = ns_end;
+            _use_tsc = true;
+        }
+#endif
+    }
+
+    static jlong now() {
+#ifdef HAVE_TSC
+        if (_use_tsc) {
+            return _ns_base + (jlong) ((long long) (__rdtsc() - _tsc_base) * _ns_per_tick);
+        }
+#endif
+        return monotonic_time();
+    }
+};
+
+bool Clock::_use_tsc = false;
+unsigned long long Clock::_tsc_base = 0;
+jlong Clock::_ns_base = 0;
+double Clock::_ns_per_tick = 0;
+static bool use_tsc = true;
+
+// Lock-free set of interned strings. String id is the index of its slot;
+// strings are never removed, so a pointer returned by lookup() stays valid forever.
+class StringTable {
+  private:
+    std::atomic<const char*> _strings[STRING_TABLE_SIZE];
+    std::atomic<unsigned long long> _overflows;
+
+    static unsigned int hash(const char* s) {
+        unsigned int h = 2166136261U;
+        for (; *s; s++) {
+            h = (h ^ (unsigned char) *s) * 16777619U;
+        }
+        return h;
+    }
+
+  public:
+    StringTable() : _overflows(0) {
+    }
+
+    // Returns string id, or 0 if the string is NULL or the table is full.
+    // Probing is short, so that a full table costs little on the calling JVM thread.
+    unsigned int intern(const char* s) {
+        if (s == NULL) {
+            return 0;
+        }
+
+        char* copy = NULL;
+        unsigned int h = hash(s);
+        for (unsigned int probe = 0; probe < MAX_STRING_PROBES; probe++) {
+            unsigned int id = (h + probe) & (STRING_TABLE_SIZE - 1);
+            if (id == 0) continue;
+
+            const char* existing = _strings[id].load(std::memory_order_acquire);
+            if (existing == NULL) {
+                if (copy == NULL) copy = strdup(s);
+                if (_strings[id].compare_exchange_strong(existing, copy, std::memory_order_acq_rel)) {
+                    return id;
+                }
+            }
+            if (strcmp(existing, s) == 0) {
+                free(copy);
+                return id;
+            }
+        }
+
+        free(copy);
+        _overflows.fetch_add(1, std::memory_order_relaxed);
+        return 0;
+    }
+
+    const char* lookup(unsigned int id) {
+        return id < STRING_TABLE_SIZE ? _strings[id].load(std::memory_order_acquire) : NULL;
+    }
+
+    unsigned long long overflows() {
+        return _overflows.load(std::memory_order_relaxed);
+    }
+};
+
+static StringTable strings;
+
+// Inline strings of the event being written; used only by the writer thread
+static const char* inline_strings[MAX_EVENT_STRINGS];
+
+static const char* lookup_string(unsigned int id) {
+    const char* s = id >= INLINE_STRING_ID ? inline_strings[id - INLINE_STRING_ID] : strings.lookup(id);
+    return s != NULL ? s : "(null)";
+}
+
+// OS thread id, cached since the syscall is not free
+static unsigned int current_tid() {
+#ifdef __linux__
+    static thread_local unsigned int tid = 0;
+    if (tid == 0) {
+        tid = (unsigned int) syscall(SYS_gettid);
+    }
+    return tid;
+#else
+    return 0;
+#endif
+}
+
+struct Event {
+    std::atomic<unsigned long long> seq;
+    EventRecord record;
+    unsigned int tid;  // needed only for the per-thread timeline of the Chrome trace format
+    char* inline_strings[MAX_EVENT_STRINGS];  // copies of names that did not fit in the string table
+};
+
+// Bounded lock-free multi-producer queue (after D. Vyukov) drained by a single writer thread.
+// A slot is free for the producer at position P when its seq == P,
+// and contains a published event for the consumer when seq == P + 1.
+class EventRing {
+  private:
+    Event _events[RING_SIZE];
+    std::atomic<unsigned long long> _tail;
+    unsigned long long _head;
+    std::atomic<jlong> _lost;
+
+  public:
+    EventRing() : _tail(0), _head(0), _lost(0) {
+        for (unsigned long long i = 0; i < RING_SIZE; i++) {
+            _events[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    // Returns a slot to fill in, or NULL if the ring is full
+    Event* reserve() {
+        unsigned long long pos = _tail.load(std::memory_order_relaxed);
+        while (true) {
+            Event* e = &_events[pos & (RING_SIZE - 1)];
+            long long diff = (long long) (e->seq.load(std::memory_order_acquire) - pos);
+            if (diff == 0) {
+                if (_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    return e;
+                }
+            } else if (diff < 0) {
+                _lost.fetch_add(1, std::memory_order_relaxed);
+                return NULL;
+            } else {
+                pos = _tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    void publish(Event* e) {
+        e->seq.store(e->seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    // Consumer side: returns the next published event, or NULL if there is none
+    Event* peek() {
+        Event* e = &_events[_head & (RING_SIZE - 1)];
+        return e->seq.load(std::memory_order_acquire) == _head + 1 ? e : NULL;
+    }
+
+    void release(Event* e) {
+        e->seq.store(_head + RING_SIZE, std::memory_order_release);
+        _head++;
+    }
+
+    jlong take_lost() {
+        return _lost.exchange(0, std::memory_order_relaxed);
+    }
+};
+
+static EventRing ring;
+
+// Events are put into the ring by JVM threads as typed records, and formatted and written
+// to disk by the writer thread in large batches, so that JVM threads never block on I/O
+static void trace_ids(jvmtiEnv* jvmti, int kind, unsigned int s0, unsigned int s1,
+                      unsigned long long arg0 = 0, unsigned long long arg1 = 0,
+                      const char* inline0 = NULL, const char* inline1 = NULL) {
+    Event* e = ring.reserve();
+    if (e == NULL) {
+        return;
+    }
+
+    EventRecord* r = &e->record;
+    r->kind = kind;
+    r->time = Clock::now() - start_time;
+    r->strings[0] = s0;
+    r->strings[1] = s1;
+    r->args[0] = arg0;
+    r->args[1] = arg1;
+    e->tid = output_format == FORMAT_CHROME ? current_tid() : 0;
+    e->inline_strings[0] = inline0 != NULL ? strdup(inline0) : NULL;
+    e->inline_strings[1] = inline1 != NULL ? strdup(inline1) : NULL;
+
+    ring.publish(e);
+}
+
+// A name that does not fit in the string table is copied into the event rather than lost
+static void trace(jvmtiEnv* jvmti, int kind,
+                  const char* s0 = NULL, const char* s1 = NULL,
+                  unsigned long long arg0 = 0, unsigned long long arg1 = 0) {
+    unsigned int id0 = strings.intern(s0);
+    unsigned int id1 = strings.intern(s1);
+    bool inline0 = id0 == 0 && s0 != NULL;
+    bool inline1 = id1 == 0 && s1 != NULL;
+    trace_ids(jvmti, kind, inline0 ? INLINE_STRING_ID : id0, inline1 ? INLINE_STRING_ID + 1 : id1,
+              arg0, arg1, inline0 ? s0 : NULL, inline1 ? s1 : NULL);
+}
+
+// Writes at most size - 1 characters of a JSON string body, never splitting an escape sequence
+static size_t json_escape(char* dst, size_t size, const char* s) {
+    size_t len = 0;
+    for (; *s != 0; s++) {
+        unsigned char c = (unsigned char) *s;
+        char esc[8];
+        int esc_len;
+        if (c == '"' || c == '\\') {
+            esc_len = snprintf(esc, sizeof(esc), "\\%c", c);
+        } else if (c < 0x20) {
+            esc_len = snprintf(esc, sizeof(esc), "\\u%04x", c);
+        } else {
+            esc[0] = c;
+            esc_len = 1;
+        }
+        if (len + esc_len >= size) {
+            break;
+        }
+        memcpy(dst + len, esc, esc_len);
+        len += esc_len;
+    }
+    dst[len] = 0;
+    return len;
+}
+
+#ifndef _WIN32
+
+// Size-capped output: a sequence of memory-mapped segment files <file>.vmtrace.0, <file>.vmtrace.1, ...
+// of which only the last `count` are kept. Data is copied straight into the shared mapping,
+// so whatever has been flushed survives a JVM crash. Segments are preallocated, and truncated
+// to the written size when closed; a segment of a crashed JVM ends with zero bytes.
+class LogSegments {
+  private:
+    const char* _file;
+    int _fd;
+    char* _map;
+    size_t _size;  // mapped size; may exceed segment_size if a write did not fit
+    size_t _used;
+    unsigned int _seq;
+    jlong _opened;
+
+    void path(char* buf, size_t size, unsigned int seq) {
+        snprintf(buf, size, "%s" SEGMENT_SUFFIX "%u", _file, seq);
+    }
+
+    bool map(size_t size) {
+        if (ftruncate(_fd, size) != 0) {
+            return false;
+        }
+        void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, _fd, 0);
+        if (p == MAP_FAILED) {
+            return false;
+        }
+        _map = (char*) p;
+        _size = size;
+        return true;
+    }
+
+    bool open_segment() {
+        char name[1024];
+        path(name, sizeof(name), _seq);
+        if ((_fd = ::open(name, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0 || !map(segment_size)) {
+            fprintf(stderr, "Cannot create log segment: %s\n", name);
+            if (_fd >= 0) close(_fd);
+            _fd = -1;
+            return false;
+        }
+
+        _used = 0;
+        _opened = 0;
+        if (_seq >= count) {
+            path(name, sizeof(name), _seq - count);
+            unlink(name);
+        }
+        return true;
+    }
+
+    // Segments left by an earlier run with the same file name would otherwise be mixed
+    // with the new ones, and never deleted if they are numbered higher. Only names
+    // with the agent's own suffix are removed, never e.g. logrotate's <file>.1
+    void remove_stale_segments() {
+        const char* slash = strrchr(_file, '/');
+        std::string dir = slash == NULL ? "." : slash == _file ? "/" : std::string(_file, slash - _file);
+        const char* base = slash == NULL ? _file : slash + 1;
+        size_t base_len = strlen(base);
+        size_t suffix_len = strlen(SEGMENT_SUFFIX);
+
+        DIR* d = opendir(dir.c_str());
+        if (d == NULL) {
+            return;
+        }
+        for (struct dirent* e; (e = readdir(d)) != NULL; ) {
+            const char* suffix = e->d_name + base_len;
+            if (strncmp(e->d_name, base, base_len) == 0 && strncmp(suffix, SEGMENT_SUFFIX, suffix_len) == 0 &&
+                suffix[suffix_len] != 0 && strspn(suffix + suffix_len, "0123456789") == strlen(suffix + suffix_len)) {
+                unlink((dir + "/" + e->d_name).c_str());
+            }
+        }
+        closedir(d);
+    }
+
+    void close_segment() {
+        munmap(_map, _size);
+        _map = NULL;
+        if (ftruncate(_fd, _used) != 0) {
+            fprintf(stderr, "Cannot truncate log segment %s" SEGMENT_SUFFIX "%u\n", _file, _seq);
+        }
+        close(_fd);
+        _fd = -1;
+    }
+
+  public:
+    size_t segment_size;  // 0 = rotation disabled
+    unsigned int count;
+    jlong interval;       // ns before switching to a new segment, 0 = size limit only
+
+    LogSegments() : _file(NULL), _fd(-1), _map(NULL), _size(0), _used(0), _seq(0), _opened(0),
+                    segment_size(0), count(5), interval(0) {
+    }
+
+    bool enabled() {
+        return _map != NULL;
+    }
+
+    bool open(const char* file) {
+        _file = file;
+        remove_stale_segments();
+        return open_segment();
+    }
+
+    // Whether the current segment has no room for pending bytes, or has expired
+    bool is_full(size_t pending) {
+        if (_used + pending > segment_size) {
+            return true;
+        }
+        jlong now = Clock::now();
+        if (_opened == 0) {
+            _opened = now;
+        }
+        return interval > 0 && now - _opened >= interval;
+    }
+
+    void rotate() {
+        close_segment();
+        _seq++;
+        open_segment();
+    }
+
+    void write(const void* data, size_t len) {
+        if (_used + len > _size) {
+            // A single oversized write extends the segment rather than splitting a record
+            munmap(_map, _size);
+            _map = NULL;
+            if (!map(_used + len)) {
+                fprintf(stderr, "Cannot extend log segment %s" SEGMENT_SUFFIX "%u\n", _file, _seq);
+                close(_fd);
+                _fd = -1;
+                return;
+            }
+        }
+        memcpy(_map + _used, data, len);
+        _used += len;
+    }
+
+    void close_all() {
+        if (_map != NULL) {
+            close_segment();
+        }
+    }
+};
+
+#else
+
+// Segments need mmap; on Windows the log is always a single file
+class LogSegments {
+  public:
+    size_t segment_size;
+    unsigned int count;
+    jlong interval;
+
+    LogSegments() : segment_size(0), count(0), interval(0) {
+    }
+
+    bool enabled() { return false; }
+    bool is_full(size_t pending) { return false; }
+    void rotate() {}
+    void write(const void* data, size_t len) {}
+    void close_all() {}
+
+    bool open(const char* file) {
+        fprintf(stderr, "vmtrace: rotate is not supported on Windows\n");
+        return false;
+    }
+};
+
+#endif // _WIN32
+
+static LogSegments segments;
+
+class LogWriter {
+  private:
+    unsigned char _buf[WRITE_BUFFER_SIZE];
+    size_t _len;
+    long long _last_time;
+    unsigned char _emitted[STRING_TABLE_SIZE / 8];  // strings already written to the binary log
+    bool _first_json_event;
+
+    void ensure(size_t size) {
+        if (_len + size > sizeof(_buf)) {
+            flush();
+        }
+    }
+
+    // Inline strings are written before every event that uses them, under reserved ids
+    void put_string(unsigned int id) {
+        if (id == 0) {
+            return;
+        } else if (id < INLINE_STRING_ID) {
+            if (_emitted[id / 8] & (1 << (id % 8))) {
+                return;
+            }
+            _emitted[id / 8] |= 1 << (id % 8);
+        }
+
+        const char* s = lookup_string(id);
+        size_t len = strlen(s);
+        if (len + 32 > sizeof(_buf)) {
+            len = sizeof(_buf) - 32;
+        }
+
+        ensure(len + 32);
+        _buf[_len++] = EVENT_STRING;
+        _len += put_varint(_buf + _len, id);
+        _len += put_varint(_buf + _len, len);
+        memcpy(_buf + _len, s, len);
+        _len += len;
+    }
+
+    void put_binary(const EventRecord* r) {
+        for (int i = 0; i < EVENT_STRING_COUNT[r->kind]; i++) {
+            put_string(r->strings[i]);
+        }
+
+        ensure(1 + 10 * (1 + MAX_EVENT_STRINGS + MAX_EVENT_ARGS));
+        _buf[_len++] = (unsigned char) r->kind;
+        _len += put_varint(_buf + _len, zigzag_encode(r->time - _last_time));
+        for (int i = 0; i < EVENT_STRING_COUNT[r->kind]; i++) {
+            _len += put_varint(_buf + _len, r->strings[i]);
+        }
+        for (int i = 0; i < EVENT_ARG_COUNT[r->kind]; i++) {
+            _len += put_varint(_buf + _len, r->args[i]);
+        }
+        _last_time = r->time;
+    }
+
+    // Text is formatted here rather than in JVM threads
+    void put_text(const EventRecord* r) {
+        ensure(MAX_LINE);
+        char* line = (char*) _buf + _len;
+        int len = snprintf(line, MAX_LINE, "[%.5f] ", r->time / 1000000000.0);
+        len += format_event(line + len, MAX_LINE - len - 1, r, lookup_string);
+        if (len > MAX_LINE - 2) {
+            len = MAX_LINE - 2;
+        }
+        line[len++] = '\n';
+        _len += len;
+    }
+
+    // Chrome trace event JSON: https://docs.google.com/document/d/1CvAClvFfyA5R-PhYUmn5OOQtYMH4h6I0nSsKchNAySU
+    // "M" = metadata, "B"/"E" = begin/end of a slice, "X" = complete slice, "i" = instant event.
+    // args is a preformatted JSON object body.
+    void put_json_event(const char* ph, const char* cat, const char* name, long long time, long long dur,
+                        unsigned int tid, bool global, const char* args) {
+        ensure(3 * MAX_LINE);
+        char* line = (char*) _buf + _len;
+        char* end = line + 3 * MAX_LINE - 4;
+        char* p = line;
+
+        p += snprintf(p, end - p, "%s{\"name\":\"", _first_json_event ? "[\n" : ",\n");
+        p += json_escape(p, end - p, name);
+        p += snprintf(p, end - p, "\",\"cat\":\"%s\",\"ph\":\"%s\",\"ts\":%.3f,\"pid\":%d,\"tid\":%u",
+                      cat, ph, time / 1000.0, (int) getpid(), tid);
+        if (dur > 0 && p < end) {
+            p += snprintf(p, end - p, ",\"dur\":%.3f", dur / 1000.0);
+        }
+        if (global && p < end) {
+            p += snprintf(p, end - p, ",\"s\":\"g\"");
+        }
+        if (args != NULL && p < end) {
+            p += snprintf(p, end - p, ",\"args\":{%s}", args);
+        }
+        if (p >= end) {
+            // Truncated: drop the event rather than break the JSON structure
+            return;
+        }
+
+        *p++ = '}';
+        _len += p - line;
+        _first_json_event = false;
+    }
+
+    // Duration events for GC and thread lifetimes, instant events for everything else
+    void put_chrome(const EventRecord* r, unsigned int tid) {
+        const char* s0 = lookup_string(r->strings[0]);
+        const char* s1 = lookup_string(r->strings[1]);
+        char name[MAX_LINE];
+        char args[MAX_LINE];
+
+        switch (r->kind) {
+            case EVENT_CLASS_LOAD:
+                snprintf(args, sizeof(args), "\"bytes\":%d", (int) r->args[0]);
+                put_json_event("i", "class", s0, r->time, 0, tid, false, args);
+                break;
+            case EVENT_CLASS_PREPARE:
+                snprintf(name, sizeof(name), "Prepare %s", s0);
+                put_json_event("i", "class", name, r->time, 0, tid, false, NULL);
+                break;
+            case EVENT_DYNAMIC_CODE:
+                snprintf(args, sizeof(args), "\"bytes\":%d", (int) r->args[0]);
+                put_json_event("i", "compiler", s0, r->time, 0, tid, false, args);
+                break;
+            case EVENT_METHOD_COMPILED:
+                snprintf(name, sizeof(name), "%s.%s", s0, s1);
+                snprintf(args, sizeof(args), "\"bytes\":%d", (int) r->args[0]);
+                put_json_event("i", "compiler", name, r->time, 0, tid, false, args);
+                break;
+            case EVENT_METHOD_FLUSHED:
+                snprintf(name, sizeof(name), "Flush %s.%s", s0, s1);
+                put_json_event("i", "compiler", name, r->time, 0, tid, false, NULL);
+                break;
+            case EVENT_THREAD_START: {
+                // Thread start and end events are delivered in the thread itself
+                char* p = args + snprintf(args, sizeof(args), "\"name\":\"");
+                p += json_escape(p, args + sizeof(args) - p - 2, s0);
+                strcpy(p, "\"");
+                put_json_event("M", "thread", "thread_name", r->time, 0, tid, false, args);
+                put_json_event("B", "thread", s0, r->time, 0, tid, false, NULL);
+                break;
+            }
+            case EVENT_THREAD_END:
+                put_json_event("E", "thread", s0, r->time, 0, tid, false, NULL);
+                break;
+            case EVENT_GC_START:
+                // The slice is written at GC finish when the pause duration is known
+                break;
+            case EVENT_GC_FINISH:
+                put_json_event("X", "gc", "GC", r->time - r->args[0], r->args[0], tid, false, NULL);
+                break;
+            default:
+                format_event(name, sizeof(name), r, lookup_string);
+                put_json_event("i", "vm", name, r->time, 0, tid, true, NULL);
+                break;
+        }
+    }
+
+    // Segments are switched only between records, and every segment is readable on its own:
+    // a binary segment has its header and string table, a JSON segment is a complete array
+    void check_rotation() {
+        if (segments.enabled() && segments.is_full(_len + WRITE_BUFFER_SIZE)) {
+            finish();
+            segments.rotate();
+            memset(_emitted, 0, sizeof(_emitted));
+            _last_time = 0;
+            _first_json_event = true;
+            start();
+        }
+    }
+
+    void put_record(const EventRecord* r, unsigned int tid) {
+        check_rotation();
+        if (output_format == FORMAT_BINARY) {
+            put_binary(r);
+        } else if (output_format == FORMAT_CHROME) {
+            put_chrome(r, tid);
+        } else {
+            put_text(r);
+        }
+    }
+
+  public:
+    LogWriter() : _len(0), _last_time(0), _first_json_event(true) {
+    }
+
+    void start() {
+        if (output_format == FORMAT_BINARY) {
+            memcpy(_buf, BINARY_LOG_MAGIC, 7);
+            _buf[7] = BINARY_LOG_VERSION;
+            _len = 8;
+        }
+    }
+
+    // Completes the JSON array; Chrome also accepts a trace without the closing bracket,
+    // so a log of a crashed JVM is still viewable
+    void finish() {
+        if (output_format == FORMAT_CHROME) {
+            ensure(4);
+            memcpy(_buf + _len, _first_json_event ? "[\n]\n" : "\n]\n", _first_json_event ? 4 : 3);
+            _len += _first_json_event ? 4 : 3;
+        }
+        flush();
+    }
+
+    // Frees inline strings of the event once it is written
+    void put(Event* e) {
+        for (int i = 0; i < MAX_EVENT_STRINGS; i++) {
+            inline_strings[i] = e->inline_strings[i];
+        }
+        put_record(&e->record, e->tid);
+        for (int i = 0; i < MAX_EVENT_STRINGS; i++) {
+            free(e->inline_strings[i]);
+            e->inline_strings[i] = NULL;
+            inline_strings[i] = NULL;
+        }
+    }
+
+    void put_lost(jlong count) {
+        EventRecord r = {EVENT_LOST, _last_time, {0, 0}, {(unsigned long long) count, 0}};
+        put_record(&r, 0);
+    }
+
+    // Reports are written by the writer thread only, so they bypass the ring
+    void put_report(long long time, const char* text) {
+        check_rotation();
+        if (output_format == FORMAT_CHROME) {
+            char args[MAX_LINE];
+            char* p = args + snprintf(args, sizeof(args), "\"text\":\"");
+            p += json_escape(p, args + sizeof(args) - p - 2, text);
+            strcpy(p, "\"");
+            put_json_event("i", "vm", "Report", time, 0, 0, true, args);
+            return;
+        }
+
+        size_t len = strlen(text);
+        if (len + 32 > sizeof(_buf)) {
+            len = sizeof(_buf) - 32;
+        }
+
+        ensure(len + 32);
+        if (output_format == FORMAT_BINARY) {
+            _buf[_len++] = EVENT_REPORT;
+            _len += put_varint(_buf + _len, zigzag_encode(time - _last_time));
+            _len += put_varint(_buf + _len, len);
+            _last_time = time;
+        } else {
+            _len += snprintf((char*) _buf + _len, 32, "[%.5f] ", time / 1000000000.0);
+        }
+        memcpy(_buf + _len, text, len);
+        _len += len;
+        if (output_format == FORMAT_TEXT) {
+            _buf[_len++] = '\n';
+        }
+    }
+
+    void flush() {
+        if (_len > 0) {
+            if (segments.enabled()) {
+                segments.write(_buf, _len);
+            } else if (out != NULL) {
+                fwrite(_buf, 1, _len, out);
+                fflush(out);
+            }
+            _len = 0;
+        }
+    }
+};
+
+static LogWriter writer;
+
+// Writes all pending events; returns false if there were none.
+// Called only by the writer thread, or at VM death if the writer has not started.
+static bool flush_events() {
+    bool written = false;
+
+    for (Event* e; (e = ring.peek()) != NULL; ring.release(e)) {
+        writer.put(e);
+        written = true;
+    }
+
+    jlong lost = ring.take_lost();
+    if (lost > 0) {
+        writer.put_lost(lost);
+        written = true;
+    }
+
+    writer.flush();
+    return written;
+}
+
+// Stats mode: instead of logging each event, JVM threads only bump counters,
+// and the writer thread prints one summary line per interval
+
+class Stats {
+  private:
+    std::atomic<long long> _classes_loaded;
+    std::atomic<long long> _class_bytes;
+    std::atomic<long long> _methods_compiled;
+    std::atomic<long long> _compiled_bytes;
+    std::atomic<long long> _methods_flushed;
+    std::atomic<long long> _threads_started;
+    std::atomic<long long> _threads_ended;
+    std::atomic<long long> _gc_count;
+    std::atomic<long long> _gc_time;
+
+    static long long take(std::atomic<long long>& counter) {
+        return counter.exchange(0, std::memory_order_relaxed);
+    }
+
+  public:
+    void class_loaded(jint bytes) {
+        _classes_loaded.fetch_add(1, std::memory_order_relaxed);
+        _class_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void method_compiled(jint bytes) {
+        _methods_compiled.fetch_add(1, std::memory_order_relaxed);
+        _compiled_bytes.fetch_add(bytes, std::memory_order_relaxed);
+    }
+
+    void method_flushed() {
+        _methods_flushed.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void thread_started() {
+        _threads_started.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void thread_ended() {
+        _threads_ended.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void gc_finished(jlong pause) {
+        _gc_count.fetch_add(1, std::memory_order_relaxed);
+        _gc_time.fetch_add(pause, std::memory_order_relaxed);
+    }
+
+    // Formats counters collected since the previous call and resets them
+    int report(char* buf, size_t size) {
+        long long class_bytes = take(_class_bytes);
+        long long compiled_bytes = take(_compiled_bytes);
+        long long gc_time = take(_gc_time);
+        return snprintf(buf, size,
+                        "Stats: classes %lld (%lld KB), compiled %lld (%lld KB), flushed %lld, "
+                        "threads +%lld -%lld, GC %lld (%.3f ms)",
+                        take(_classes_loaded), class_bytes / 1024,
+                        take(_methods_compiled), compiled_bytes / 1024,
+                        take(_methods_flushed),
+                        take(_threads_started), take(_threads_ended),
+                        take(_gc_count), gc_time / 1000000.0);
+    }
+};
+
+#ifndef _WIN32
+
+// Counters exported through a memory-mapped file for scraping without log parsing.
+// Updated from any callback, including GC ones: only relaxed atomics on the mapping.
+class SharedCounters {
+  private:
+    CounterFileHeader* _header;
+    CounterEntry* _entries;
+    size_t _size;
+    char _path[1024];
+
+  public:
+    SharedCounters() : _header(NULL), _entries(NULL), _size(0) {
+        _path[0] = 0;
+    }
+
+    bool enabled() {
+        return _header != NULL;
+    }
+
+    // Like hsperfdata, the default file lives in a per-user directory that nobody else
+    // can write to, so another user cannot plant a file or a symlink in place of it
+    bool default_path() {
+        char dir[512];
+        struct passwd* pw = getpwuid(geteuid());
+        if (pw != NULL) {
+            snprintf(dir, sizeof(dir), COUNTERS_DIR, pw->pw_name);
+        } else {
+            char uid[16];
+            snprintf(uid, sizeof(uid), "%u", (unsigned int) geteuid());
+            snprintf(dir, sizeof(dir), COUNTERS_DIR, uid);
+        }
+
+        struct stat st;
+        if (mkdir(dir, 0700) != 0 && errno != EEXIST) {
+            fprintf(stderr, "Cannot create counter directory: %s\n", dir);
+            return false;
+        }
+        if (lstat(dir, &st) != 0 || !S_ISDIR(st.st_mode) || st.st_uid != geteuid() || (st.st_mode & 077) != 0) {
+            fprintf(stderr, "Counter directory is not private to the user: %s\n", dir);
+            return false;
+        }
+
+        snprintf(_path, sizeof(_path), "%s/%d.counters", dir, (int) getpid());
+        return true;
+    }
+
+    void open(const char* file) {
+        if (file != NULL && file[0]) {
+            snprintf(_path, sizeof(_path), "%s", file);
+        } else if (!default_path()) {
+            return;
+        }
+
+        // A stale file of a previous process with the same pid is replaced;
+        // a symlink or a file created in between is never opened
+        _size = sizeof(CounterFileHeader) + COUNTER_COUNT * sizeof(CounterEntry);
+        unlink(_path);
+        int fd = ::open(_path, O_RDWR | O_CREAT | O_EXCL | O_NOFOLLOW, 0644);
+        void* p = fd < 0 || ftruncate(fd, _size) != 0 ? MAP_FAILED
+                  : mmap(NULL, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (fd >= 0) {
+            close(fd);
+        }
+        if (p == MAP_FAILED) {
+            fprintf(stderr, "Cannot create counter file: %s\n", _path);
+            return;
+        }
+
+        CounterFileHeader* header = (CounterFileHeader*) p;
+        _entries = (CounterEntry*) (header + 1);
+        for (int i = 0; i < COUNTER_COUNT; i++) {
+            strncpy(_entries[i].name, COUNTER_NAMES[i], COUNTER_NAME_SIZE - 1);
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        header->start_time = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+        header->pid = (int) getpid();
+        header->count = COUNTER_COUNT;
+        header->version = COUNTERS_VERSION;
+        // Magic goes last, so a reader never sees a half-initialized file as valid
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(header->magic, COUNTERS_MAGIC, sizeof(header->magic));
+        _header = header;
+    }
+
+    void close_file() {
+        if (_header != NULL) {
+            munmap(_header, _size);
+            _header = NULL;
+            unlink(_path);
+        }
+    }
+
+    void add(int id, long long delta) {
+        if (_header != NULL) {
+            __atomic_fetch_add(&_entries[id].value, delta, __ATOMIC_RELAXED);
+        }
+    }
+
+    void update_max(int id, long long value) {
+        if (_header != NULL) {
+            long long prev = __atomic_load_n(&_entries[id].value, __ATOMIC_RELAXED);
+            while (value > prev && !__atomic_compare_exchange_n(&_entries[id].value, &prev, value, true,
+                                                                 __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                // prev is reloaded by the failed exchange
+            }
+        }
+    }
+};
+
+#else
+
+class SharedCounters {
+  public:
+    bool enabled() { return false; }
+    void close_file() {}
+    void add(int id, long long delta) {}
+    void update_max(int id, long long value) {}
+
+    void open(const char* file) {
+        fprintf(stderr, "vmtrace: counters are not supported on Windows\n");
+    }
+};
+
+#endif // _WIN32
+
+static SharedCounters counters;
+static bool counters_enabled = false;
+static const char* counters_file = NULL;
+
+// HDR-style histogram of GC pauses in microseconds: each power of 2 is split
+// into linear sub-buckets, which keeps relative error within 1/PAUSE_SUB_BUCKETS.
+// Recorded from GC callbacks, where allocation is not allowed, hence the fixed array.
+class PauseHistogram {
+  private:
+    std::atomic<unsigned int> _counts[PAUSE_BUCKETS];
+    std::atomic<long long> _count;
+    std::atomic<long long> _total;
+    std::atomic<long long> _max;
+
+    static int bucket(unsigned long long us) {
+        if (us < PAUSE_SUB_BUCKETS) {
+            return (int) us;
+        }
+        int shift = -4;  // 4 = log2(PAUSE_SUB_BUCKETS)
+        for (unsigned long long v = us; v > 1; v >>= 1) {
+            shift++;
+        }
+        int index = (shift + 1) * PAUSE_SUB_BUCKETS + (int) (us >> shift) - PAUSE_SUB_BUCKETS;
+        return index < PAUSE_BUCKETS ? index : PAUSE_BUCKETS - 1;
+    }
+
+    // The largest value that falls into the bucket
+    static unsigned long long bucket_limit(int index) {
+        if (index < PAUSE_SUB_BUCKETS) {
+            return index;
+        }
+        int shift = index / PAUSE_SUB_BUCKETS - 1;
+        return ((unsigned long long) (index % PAUSE_SUB_BUCKETS + PAUSE_SUB_BUCKETS + 1) << shift) - 1;
+    }
+
+    static unsigned long long percentile(const unsigned int* counts, long long count, double p) {
+        long long rank = (long long) (count * p + 0.999999);
+        long long seen = 0;
+        for (int i = 0; i < PAUSE_BUCKETS; i++) {
+            if ((seen += counts[i]) >= rank) {
+                return bucket_limit(i);
+            }
+        }
+        return bucket_limit(PAUSE_BUCKETS - 1);
+    }
+
+  public:
+    void record(jlong ns) {
+        long long us = ns / 1000;
+        _counts[bucket(us)].fetch_add(1, std::memory_order_relaxed);
+        _count.fetch_add(1, std::memory_order_relaxed);
+        _total.fetch_add(us, std::memory_order_relaxed);
+
+        long long max = _max.load(std::memory_order_relaxed);
+        while (us > max && !_max.compare_exchange_weak(max, us, std::memory_order_relaxed)) {
+            // retry
+        }
+    }
+
+    // Formats pauses recorded since the previous call and resets the histogram;
+    // returns 0 if there were no pauses
+    int report(char* buf, size_t size) {
+        unsigned int counts[PAUSE_BUCKETS];
+        for (int i = 0; i < PAUSE_BUCKETS; i++) {
+            counts[i] = _counts[i].exchange(0, std::memory_order_relaxed);
+        }
+        long long count = _count.exchange(0, std::memory_order_relaxed);
+        long long total = _total.exchange(0, std::memory_order_relaxed);
+        long long max = _max.exchange(0, std::memory_order_relaxed);
+
+        if (count == 0) {
+            return 0;
+        }
+
+        // Bucket limits may exceed the exact maximum
+        unsigned long long p50 = percentile(counts, count, 0.5);
+        unsigned long long p99 = percentile(counts, count, 0.99);
+        return snprintf(buf, size, "GC pauses: %lld (%.3f ms), p50 %.3f ms, p99 %.3f ms, max %.3f ms",
+                        count, total / 1000.0,
+                        (p50 < (unsigned long long) max ? p50 : max) / 1000.0,
+                        (p99 < (unsigned long long) max ? p99 : max) / 1000.0,
+                        max / 1000.0);
+    }
+};
+
+static Stats stats;
+static bool stats_mode = false;
+static jlong stats_interval = 1000000000;  // ns
+
+static PauseHistogram gc_pauses;
+static jlong gc_pauses_interval = 0;  // ns between pause histogram reports, 0 = disabled
+static jlong gc_start_time = 0;       // GC callbacks are serialized at a safepoint
+static jlong long_gc_pause = 0;       // ns, 0 = do not report long pauses
+
+static void write_stats() {
+    char buf[MAX_LINE];
+    stats.report(buf, sizeof(buf));
+    writer.put_report(Clock::now() - start_time, buf);
+    writer.flush();
+}
+
+static void write_gc_pause_report() {
+    char buf[MAX_LINE];
+    if (gc_pauses.report(buf, sizeof(buf)) > 0) {
+        writer.put_report(Clock::now() - start_time, buf);
+        writer.flush();
+    }
+}
+
+static void appendf(std::string& s, const char* fmt, ...) {
+    char buf[MAX_LINE];
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    s += buf;
+}
+
+static const char* JDK_PACKAGES[] = {"java/", "javax/", "jdk/", "sun/", "com/sun/", NULL};
+
+static bool is_jdk_class(const char* name) {
+    for (const char** prefix = JDK_PACKAGES; *prefix != NULL; prefix++) {
+        if (strncmp(name, *prefix, strlen(*prefix)) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Class loading latency: time from ClassFileLoadHook to ClassPrepare of each class,
+// attributed to the defining loader. The time is inclusive: it covers loading
+// of superclasses and interfaces, and the time before the class is linked.
+
+struct ClassTiming {
+    std::string name;
+    std::string loader;
+    jlong load_time;  // since vmtrace start
+    jlong latency;
+};
+
+struct TimingTotal {
+    int count;
+    jlong latency;
+};
+
+static bool by_latency(const ClassTiming* a, const ClassTiming* b) {
+    return a->latency > b->latency;
+}
+
+static bool by_total_latency(const std::pair<std::string, TimingTotal>& a,
+                             const std::pair<std::string, TimingTotal>& b) {
+    return a.second.latency > b.second.latency;
+}
+
+class ClassLoadProfile {
+  private:
+    jrawMonitorID _lock;
+    std::unordered_map<std::string, jlong> _pending;  // by class name and defining loader
+    size_t _scan_size;  // _pending size that triggers the next scan for stale entries
+    int _abandoned;     // failed definitions and other classes that were never prepared
+    std::vector<ClassTiming> _classes;
+    std::vector<size_t> _first_app_classes;
+    jlong _vm_start;
+    jlong _vm_init;
+
+    // Different loaders may load a class of the same name at the same time
+    static std::string pending_key(jvmtiEnv* jvmti, const char* name, jobject loader) {
+        if (loader == NULL) {
+            return name;
+        }
+        jint hash = 0;
+        jvmti->GetObjectHashCode(loader, &hash);
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "@%x", hash);
+        return std::string(name) + suffix;
+    }
+
+    // Scans only when the map has doubled since the last scan, so the cost is amortized
+    void remove_stale(jlong now) {
+        if (_pending.size() < _scan_size) {
+            return;
+        }
+        for (std::unordered_map<std::string, jlong>::iterator it = _pending.begin(); it != _pending.end(); ) {
+            if (now - it->second > CLASS_PENDING_TIMEOUT) {
+                it = _pending.erase(it);
+                _abandoned++;
+            } else {
+                ++it;
+            }
+        }
+        _scan_size = _pending.size() * 2 > CLASS_PENDING_MIN_SCAN
+                     ? _pending.size() * 2 : CLASS_PENDING_MIN_SCAN;
+    }
+
+    static void report_totals(std::string& out, const char* title,
+                              const std::map<std::string, TimingTotal>& totals, int top) {
+        std::vector<std::pair<std::string, TimingTotal> > sorted(totals.begin(), totals.end());
+        std::sort(sorted.begin(), sorted.end(), by_total_latency);
+
+        appendf(out, "%s:\n", title);
+        for (size_t i = 0; i < sorted.size() && (int) i < top; i++) {
+            appendf(out, "  %10.3f ms  %6d classes  %s\n", sorted[i].second.latency / 1000000.0,
+                    sorted[i].second.count, sorted[i].first.c_str());
+        }
+    }
+
+  public:
+    // Number of entries in each section of the report; 0 = disabled
+    int top;
+
+    ClassLoadProfile() : _scan_size(CLASS_PENDING_MIN_SCAN), _abandoned(0), _vm_start(0), _vm_init(0), top(0) {
+    }
+
+    void init(jvmtiEnv* jvmti) {
+        jvmti->CreateRawMonitor("classload_lock", &_lock);
+    }
+
+    void vm_started() {
+        _vm_start = Clock::now() - start_time;
+    }
+
+    void vm_initialized() {
+        _vm_init = Clock::now() - start_time;
+    }
+
+    void loading(jvmtiEnv* jvmti, const char* name, jobject loader) {
+        std::string key = pending_key(jvmti, name, loader);
+        jlong now = Clock::now();
+        jvmti->RawMonitorEnter(_lock);
+        _pending[key] = now;
+        remove_stale(now);
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    // Loader is NULL for the bootstrap class loader
+    void prepared(jvmtiEnv* jvmti, const char* name, jobject loader_object, const char* loader) {
+        std::string key = pending_key(jvmti, name, loader_object);
+        jlong now = Clock::now();
+        jvmti->RawMonitorEnter(_lock);
+
+        std::unordered_map<std::string, jlong>::iterator it = _pending.find(key);
+        if (it != _pending.end()) {
+            ClassTiming timing = {name, loader != NULL ? loader : "bootstrap",
+                                  it->second - start_time, now - it->second};
+            _pending.erase(it);
+
+            if (loader != NULL && (int) _first_app_classes.size() < top && !is_jdk_class(name)) {
+                _first_app_classes.push_back(_classes.size());
+            }
+            _classes.push_back(timing);
+        }
+
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    void report(jvmtiEnv* jvmti, std::string& out) {
+        jvmti->RawMonitorEnter(_lock);
+
+        std::vector<const ClassTiming*> slowest;
+        std::map<std::string, TimingTotal> packages;
+        std::map<std::string, TimingTotal> loaders;
+        jlong total = 0;
+
+        for (size_t i = 0; i < _classes.size(); i++) {
+            const ClassTiming* c = &_classes[i];
+            slowest.push_back(c);
+            total += c->latency;
+
+            size_t slash = c->name.rfind('/');
+            TimingTotal& p = packages[slash == std::string::npos ? "(default)" : c->name.substr(0, slash)];
+            p.count++;
+            p.latency += c->latency;
+
+            TimingTotal& l = loaders[c->loader];
+            l.count++;
+            l.latency += c->latency;
+        }
+
+        size_t count = slowest.size() < (size_t) top ? slowest.size() : (size_t) top;
+        std::partial_sort(slowest.begin(), slowest.begin() + count, slowest.end(), by_latency);
+
+        appendf(out, "Class loading: %d classes, %.3f ms from load to prepare, "
+                "%d not prepared yet, %d never prepared\n",
+                (int) _classes.size(), total / 1000000.0, (int) _pending.size(), _abandoned);
+        appendf(out, "VM started at %.3f ms, initialized at %.3f ms\n",
+                _vm_start / 1000000.0, _vm_init / 1000000.0);
+
+        appendf(out, "First application classes:\n");
+        for (size_t i = 0; i < _first_app_classes.size(); i++) {
+            const ClassTiming* c = &_classes[_first_app_classes[i]];
+            appendf(out, "  %10.3f ms  %s\n", c->load_time / 1000000.0, c->name.c_str());
+        }
+
+        appendf(out, "Slowest classes:\n");
+        for (size_t i = 0; i < count; i++) {
+            appendf(out, "  %10.3f ms  %s (%s)\n", slowest[i]->latency / 1000000.0,
+                    slowest[i]->name.c_str(), slowest[i]->loader.c_str());
+        }
+
+        report_totals(out, "Slowest packages", packages, top);
+        report_totals(out, "Class loaders", loaders, top);
+
+        jvmti->RawMonitorExit(_lock);
+    }
+};
+
+static ClassLoadProfile class_loads;
+
+// Code cache occupancy model: a live interval map of compiled methods and stubs
+// built from code load and unload events, without polling the JVM
+
+struct CodeBlob {
+    unsigned long long size;
+    bool method;           // false for stubs
+    unsigned int package;  // interned package name; 0 if the string table is full
+};
+
+struct PackageSize {
+    unsigned int package;
+    unsigned long long size;
+};
+
+static bool by_size(const PackageSize& a, const PackageSize& b) {
+    return a.size > b.size;
+}
+
+class CodeCacheMap {
+  private:
+    jrawMonitorID _lock;
+    std::map<uintptr_t, CodeBlob> _blobs;
+    unsigned long long _loaded;     // bytes since the last summary
+    unsigned long long _unloaded;
+
+    // Removes blobs overlapping the range, e.g. stubs that were freed without an event
+    void remove_overlapping(uintptr_t start, uintptr_t end) {
+        std::map<uintptr_t, CodeBlob>::iterator it = _blobs.lower_bound(start);
+        if (it != _blobs.begin()) {
+            std::map<uintptr_t, CodeBlob>::iterator prev = it;
+            if ((--prev)->first + prev->second.size > start) {
+                it = prev;
+            }
+        }
+        while (it != _blobs.end() && it->first < end) {
+            _blobs.erase(it++);
+        }
+    }
+
+  public:
+    jlong interval;  // ns between summaries, 0 = disabled
+
+    CodeCacheMap() : _loaded(0), _unloaded(0), interval(0) {
+    }
+
+    void init(jvmtiEnv* jvmti) {
+        jvmti->CreateRawMonitor("codecache_lock", &_lock);
+    }
+
+    void load(jvmtiEnv* jvmti, const void* code_addr, jint code_size, const char* holder) {
+        unsigned int package = 0;
+        if (holder != NULL) {
+            char buf[MAX_LINE];
+            const char* slash = strrchr(holder, '/');
+            snprintf(buf, sizeof(buf), "%.*s", slash == NULL ? 0 : (int) (slash - holder), holder);
+            package = strings.intern(buf[0] ? buf : "(default)");
+        }
+
+        uintptr_t start = (uintptr_t) code_addr;
+        CodeBlob blob = {(unsigned long long) code_size, holder != NULL, package};
+
+        jvmti->RawMonitorEnter(_lock);
+        remove_overlapping(start, start + code_size);
+        _blobs[start] = blob;
+        _loaded += code_size;
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    void unload(jvmtiEnv* jvmti, const void* code_addr) {
+        jvmti->RawMonitorEnter(_lock);
+        std::map<uintptr_t, CodeBlob>::iterator it = _blobs.find((uintptr_t) code_addr);
+        if (it != _blobs.end()) {
+            _unloaded += it->second.size;
+            _blobs.erase(it);
+        }
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    // Periodic summary counts churn since the previous summary;
+    // the full report also lists top packages by compiled code size
+    void report(jvmtiEnv* jvmti, std::string& out, bool full) {
+        jvmti->RawMonitorEnter(_lock);
+
+        unsigned long long methods = 0, stubs = 0, free = 0, largest_gap = 0;
+        int method_count = 0, gaps = 0;
+        std::map<unsigned int, unsigned long long> packages;
+        uintptr_t end = 0;
+
+        for (std::map<uintptr_t, CodeBlob>::const_iterator it = _blobs.begin(); it != _blobs.end(); ++it) {
+            if (it->second.method) {
+                methods += it->second.size;
+                method_count++;
+                packages[it->second.package] += it->second.size;
+            } else {
+                stubs += it->second.size;
+            }
+
+            unsigned long long gap = end == 0 ? 0 : it->first - end;
+            if (gap > 0 && gap < CODE_HEAP_GAP) {
+                free += gap;
+                gaps++;
+                largest_gap = gap > largest_gap ? gap : largest_gap;
+            }
+            end = it->first + it->second.size;
+        }
+
+        // External fragmentation: share of free space not in the largest hole
+        appendf(out, "Code cache: %llu KB used (methods %llu KB in %d blobs, stubs %llu KB), "
+                "free %llu KB in %d gaps (largest %llu KB, fragmentation %d%%), loaded %llu KB, unloaded %llu KB",
+                (methods + stubs) / 1024, methods / 1024, method_count, stubs / 1024,
+                free / 1024, gaps, largest_gap / 1024, free == 0 ? 0 : (int) (100 - largest_gap * 100 / free),
+                _loaded / 1024, _unloaded / 1024);
+        if (!full) {
+            _loaded = _unloaded = 0;
+        }
+
+        jvmti->RawMonitorExit(_lock);
+
+        if (full) {
+            std::vector<PackageSize> sorted;
+            for (std::map<unsigned int, unsigned long long>::const_iterator it = packages.begin(); it != packages.end(); ++it) {
+                PackageSize ps = {it->first, it->second};
+                sorted.push_back(ps);
+            }
+            size_t count = sorted.size() < 20 ? sorted.size() : 20;
+            std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(), by_size);
+
+            out += "\nTop packages by compiled code size:";
+            for (size_t i = 0; i < count; i++) {
+                appendf(out, "\n  %10llu KB  %s", sorted[i].size / 1024,
+                        sorted[i].package != 0 ? strings.lookup(sorted[i].package) : "(unknown)");
+            }
+        }
+        out += "\n";
+    }
+};
+
+static CodeCacheMap code_cache;
+static volatile bool dump_requested = false;
+
+static void write_code_cache_summary(jvmtiEnv* jvmti) {
+    std::string summary;
+    code_cache.report(jvmti, summary, false);
+    summary.erase(summary.size() - 1);
+    writer.put_report(Clock::now() - start_time, summary.c_str());
+    writer.flush();
+}
+
+static char* fix_class_name(char* class_name) {
+    // Strip 'L' and ';' from class signature
+    class_name[strlen(class_name) - 1] = 0;
+    return class_name + 1;
+}
+
+
+class ClassName {
+  private:
+    jvmtiEnv* _jvmti;
+    char* _name;
+
+  public:
+    ClassName(jvmtiEnv* jvmti, jclass klass) : _jvmti(jvmti), _name(NULL) {
+        _jvmti->GetClassSignature(klass, &_name, NULL);
+    }
+
+    ~ClassName() {
+        _jvmti->Deallocate((unsigned char*) _name);
+    }
+
+    char* name() {
+        return _name == NULL ? NULL : fix_class_name(_name);
+    }
+};
+
+class MethodName {
+  private:
+    jvmtiEnv* _jvmti;
+    char* _holder_name;
+    char* _method_name;
+    char* _signature;
+
+  public:
+    MethodName(jvmtiEnv* jvmti, jmethodID method) : _jvmti(jvmti),
+                                                    _holder_name(NULL),
+                                                    _method_name(NULL),
+                                                    _signature(NULL) {
+        jclass holder;
+        if (_jvmti->GetMethodDeclaringClass(method, &holder) == 0) {
+            _jvmti->GetClassSignature(holder, &_holder_name, NULL);
+            _jvmti->GetMethodName(method, &_method_name, &_signature, NULL);
+        }
+    }
+
+    ~MethodName() {
+        _jvmti->Deallocate((unsigned char*) _signature);
+        _jvmti->Deallocate((unsigned char*) _method_name);
+        _jvmti->Deallocate((unsigned char*) _holder_name);
+    }
+
+    char* holder() {
+        return _holder_name == NULL ? NULL : fix_class_name(_holder_name);
+    }
+
+    char* name() {
+        return _method_name;
+    }
+
+    char* signature() {
+        return _signature;
+    }
+};
+
+// Interned holder and method names cached by jmethodID, so that repeated events
+// for the same method cost no JVM TI calls. Also keeps names of unloaded methods.
+struct ChurnEntry {
+    unsigned long long names;
+    unsigned int compiles;
+    unsigned int unloads;
+    unsigned int bytes;
+};
+
+static bool by_compiles(const ChurnEntry& a, const ChurnEntry& b) {
+    return a.compiles > b.compiles;
+}
+
+class MethodCache {
+  private:
+    struct Entry {
+        std::atomic<jmethodID> method;
+        std::atomic<unsigned long long> names;  // holder id << 32 | name id, 0 if not resolved yet
+        // Recompilation churn counters for the current window
+        std::atomic<unsigned int> compiles;
+        std::atomic<unsigned int> unloads;
+        std::atomic<unsigned int> bytes;
+    };
+
+    Entry _entries[METHOD_CACHE_SIZE];
+
+    static unsigned int hash(jmethodID method) {
+        unsigned long long h = (unsigned long long) (uintptr_t) method * 0x9e3779b97f4a7c15ULL;
+        return (unsigned int) (h >> 32);
+    }
+
+    Entry* find(jmethodID method, bool insert) {
+        for (unsigned int i = hash(method), probes = 0; probes < 32; i++, probes++) {
+            Entry* e = &_entries[i & (METHOD_CACHE_SIZE - 1)];
+            jmethodID m = e->method.load(std::memory_order_acquire);
+            if (m == method) {
+                return e;
+            } else if (m == NULL) {
+                if (!insert) return NULL;
+                if (e->method.compare_exchange_strong(m, method) || m == method) return e;
+            }
+        }
+        return NULL;
+    }
+
+  public:
+    void lookup(jvmtiEnv* jvmti, jmethodID method, unsigned int* holder, unsigned int* name) {
+        Entry* e = find(method, true);
+        unsigned long long names = e != NULL ? e->names.load(std::memory_order_acquire) : 0;
+        if (names == 0) {
+            MethodName mn(jvmti, method);
+            names = (unsigned long long) strings.intern(mn.holder()) << 32 | strings.intern(mn.name());
+            if (e != NULL) e->names.store(names, std::memory_order_release);
+        }
+        *holder = (unsigned int) (names >> 32);
+        *name = (unsigned int) names;
+    }
+
+    void compiled(jmethodID method, jint code_size) {
+        Entry* e = find(method, true);
+        if (e != NULL) {
+            e->compiles.fetch_add(1, std::memory_order_relaxed);
+            e->bytes.fetch_add(code_size, std::memory_order_relaxed);
+        }
+    }
+
+    void unloaded(jmethodID method) {
+        Entry* e = find(method, false);
+        if (e != NULL) {
+            e->unloads.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    // Collects methods compiled at least threshold times in the window, and starts a new window
+    void take_churn(unsigned int threshold, std::vector<ChurnEntry>& out) {
+        for (unsigned int i = 0; i < METHOD_CACHE_SIZE; i++) {
+            Entry* e = &_entries[i];
+            if (e->compiles.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+
+            ChurnEntry c = {e->names.load(std::memory_order_acquire),
+                            e->compiles.exchange(0, std::memory_order_relaxed),
+                            e->unloads.exchange(0, std::memory_order_relaxed),
+                            e->bytes.exchange(0, std::memory_order_relaxed)};
+            if (c.compiles >= threshold) {
+                out.push_back(c);
+            }
+        }
+    }
+};
+
+static MethodCache methods;
+
+// Recompilation churn: methods compiled again and again, e.g. after repeated deoptimization
+static unsigned int churn_threshold = 0;  // compilations per window, 0 = disabled
+static jlong churn_window = 60000000000LL;
+
+static void write_churn_report() {
+    std::vector<ChurnEntry> churn;
+    methods.take_churn(churn_threshold, churn);
+    if (churn.empty()) {
+        return;
+    }
+
+    std::sort(churn.begin(), churn.end(), by_compiles);
+
+    std::string report;
+    appendf(report, "Recompilation churn: %d methods compiled %u+ times in %g s",
+            (int) churn.size(), churn_threshold, churn_window / 1000000000.0);
+    for (size_t i = 0; i < churn.size() && i < 20; i++) {
+        appendf(report, "\n  %6u compiles  %6u unloads  %8u bytes  %s.%s",
+                churn[i].compiles, churn[i].unloads, churn[i].bytes,
+                lookup_string((unsigned int) (churn[i].names >> 32)), lookup_string((unsigned int) churn[i].names));
+    }
+
+    writer.put_report(Clock::now() - start_time, report.c_str());
+    writer.flush();
+}
+
+static volatile bool writer_started = false;
+static volatile bool writer_stopping = false;
+static volatile bool writer_stopped = false;
+
+class ThreadName {
+  private:
+    jvmtiEnv* _jvmti;
+    char* _name;
+
+  public:
+    ThreadName(jvmtiEnv* jvmti, jthread thread) : _jvmti(jvmti), _name(NULL) {
+        jvmtiThreadInfo info;
+        _name = _jvmti->GetThreadInfo(thread, &info) == 0 ? info.name : NULL;
+    }
+
+    ~ThreadName() {
+        _jvmti->Deallocate((unsigned char*) _name);
+    }
+
+    char* name() {
+        return _name;
+    }
+};
+
+static bool run_agent_thread(jvmtiEnv* jvmti, JNIEnv* env, const char* name, jvmtiStartFunction proc) {
+    jclass Thread = env->FindClass("java/lang/Thread");
+    jmethodID init = env->GetMethodID(Thread, "<init>", "(Ljava/lang/String;)V");
+    jobject thread = env->NewObject(Thread, init, env->NewStringUTF(name));
+    if (thread != NULL && jvmti->RunAgentThread(thread, proc, NULL, JVMTI_THREAD_MAX_PRIORITY) == 0) {
+        return true;
+    }
+    env->ExceptionClear();
+    fprintf(stderr, "vmtrace: cannot start %s thread\n", name);
+    return false;
+}
+
+// AppCDS class list in the -XX:SharedClassListFile format, in the order classes are prepared.
+// CDS finds classes of custom loaders by id, super, interfaces and source;
+// a superclass and interfaces are always prepared before the class itself.
+
+enum LoaderKind {
+    LOADER_BOOT,
+    LOADER_PLATFORM,
+    LOADER_APP,
+    LOADER_CUSTOM
+};
+
+static int loader_kind(jvmtiEnv* jvmti, JNIEnv* env, jobject loader) {
+    if (loader == NULL) {
+        return LOADER_BOOT;
+    }
+
+    ClassName cn(jvmti, env->GetObjectClass(loader));
+    char* name = cn.name();
+    if (name == NULL) {
+        return LOADER_CUSTOM;
+    } else if (strcmp(name, "jdk/internal/loader/ClassLoaders$AppClassLoader") == 0 ||
+               strcmp(name, "sun/misc/Launcher$AppClassLoader") == 0) {
+        return LOADER_APP;
+    } else if (strcmp(name, "jdk/internal/loader/ClassLoaders$PlatformClassLoader") == 0 ||
+               strcmp(name, "sun/misc/Launcher$ExtClassLoader") == 0) {
+        return LOADER_PLATFORM;
+    }
+    return LOADER_CUSTOM;
+}
+
+static int hex_digit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+// Decodes %XX escapes of a URL path, so that a jar in a directory with spaces is found by CDS
+static std::string url_decode(const char* s) {
+    std::string result;
+    for (; *s != 0; s++) {
+        int hi, lo;
+        if (s[0] == '%' && (hi = hex_digit(s[1])) >= 0 && (lo = hex_digit(s[2])) >= 0) {
+            result += (char) (hi << 4 | lo);
+            s += 2;
+        } else {
+            result += *s;
+        }
+    }
+    return result;
+}
+
+static thread_local bool in_code_source = false;
+
+// Path of the jar or directory the class comes from: protection_domain.codesource.location.path.
+// Runs inside ClassFileLoadHook, so fields are read directly rather than by calling Java methods,
+// which could load more classes; a nested call on the same thread gets no source anyway.
+static std::string code_source(JNIEnv* env, jobject protection_domain) {
+    static jfieldID pd_codesource = NULL;
+    static jfieldID cs_location = NULL;
+    static jfieldID url_path = NULL;
+
+    std::string result;
+    if (protection_domain == NULL || in_code_source || env->PushLocalFrame(16) != 0) {
+        return result;
+    }
+    in_code_source = true;
+
+    if (url_path == NULL) {
+        jclass ProtectionDomain = env->FindClass("java/security/ProtectionDomain");
+        jclass CodeSource = env->FindClass("java/security/CodeSource");
+        jclass URL = env->FindClass("java/net/URL");
+        if (ProtectionDomain != NULL && CodeSource != NULL && URL != NULL) {
+            pd_codesource = env->GetFieldID(ProtectionDomain, "codesource", "Ljava/security/CodeSource;");
+            cs_location = env->GetFieldID(CodeSource, "location", "Ljava/net/URL;");
+            url_path = env->GetFieldID(URL, "path", "Ljava/lang/String;");
+        }
+    }
+
+    if (pd_codesource != NULL && cs_location != NULL && url_path != NULL) {
+        jobject cs = env->GetObjectField(protection_domain, pd_codesource);
+        jobject url = cs == NULL ? NULL : env->GetObjectField(cs, cs_location);
+        jstring path = url == NULL ? NULL : (jstring) env->GetObjectField(url, url_path);
+
+        const char* c_path = path == NULL ? NULL : env->GetStringUTFChars(path, NULL);
+        if (c_path != NULL) {
+            result = url_decode(c_path);
+            env->ReleaseStringUTFChars(path, c_path);
+        }
+    }
+
+    env->ExceptionClear();
+    env->PopLocalFrame(NULL);
+    in_code_source = false;
+    return result;
+}
+
+// Hidden classes and lambda proxies are generated at run time and cannot be listed
+static bool is_generated_class(const char* name) {
+    return strstr(name, "/0x") != NULL || strstr(name, "+0x") != NULL || strstr(name, "$$Lambda") != NULL;
+}
+
+struct ClassSource {
+    int major_version;
+    std::string source;  // only for custom loaders
+};
+
+class ClassListRecorder {
+  private:
+    jrawMonitorID _lock;
+    std::unordered_map<std::string, ClassSource> _pending;
+    std::unordered_map<std::string, int> _ids;
+    std::vector<std::string> _lines;
+
+    // Classes of built-in loaders are identified by name; custom loaders may define the same name
+    static std::string class_key(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, const char* name, bool* custom) {
+        jobject loader = NULL;
+        jvmti->GetClassLoader(klass, &loader);
+        return loader_key(jvmti, env, name, loader, custom);
+    }
+
+    static std::string loader_key(jvmtiEnv* jvmti, JNIEnv* env, const char* name, jobject loader, bool* custom) {
+        *custom = loader_kind(jvmti, env, loader) == LOADER_CUSTOM;
+        if (!*custom) {
+            return name;
+        }
+
+        jint hash = 0;
+        jvmti->GetObjectHashCode(loader, &hash);
+        char suffix[16];
+        snprintf(suffix, sizeof(suffix), "@%x", hash);
+        return std::string(name) + suffix;
+    }
+
+    // Returns -1 if the class is not in the list
+    int class_id(jvmtiEnv* jvmti, JNIEnv* env, jclass klass) {
+        ClassName cn(jvmti, klass);
+        char* name = cn.name();
+        if (name == NULL) {
+            return -1;
+        }
+
+        bool custom;
+        std::unordered_map<std::string, int>::iterator it = _ids.find(class_key(jvmti, env, klass, name, &custom));
+        return it != _ids.end() ? it->second : -1;
+    }
+
+  public:
+    const char* file;
+
+    ClassListRecorder() : file(NULL) {
+    }
+
+    void init(jvmtiEnv* jvmti) {
+        jvmti->CreateRawMonitor("classlist_lock", &_lock);
+    }
+
+    void loading(jvmtiEnv* jvmti, JNIEnv* env, const char* name, jobject loader, jobject protection_domain,
+                 jint data_len, const unsigned char* data) {
+        bool custom;
+        std::string key = loader_key(jvmti, env, name, loader, &custom);
+
+        ClassSource source;
+        source.major_version = data_len >= 8 ? data[6] << 8 | data[7] : 0;
+        if (custom) {
+            source.source = code_source(env, protection_domain);
+        }
+
+        jvmti->RawMonitorEnter(_lock);
+        _pending[key] = source;
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    void prepared(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, const char* name) {
+        if (is_generated_class(name)) {
+            return;
+        }
+
+        bool custom;
+        std::string key = class_key(jvmti, env, klass, name, &custom);
+
+        jvmti->RawMonitorEnter(_lock);
+
+        ClassSource source = {0, ""};
+        std::unordered_map<std::string, ClassSource>::iterator it = _pending.find(key);
+        if (it != _pending.end()) {
+            source = it->second;
+            _pending.erase(it);
+        }
+
+        // CDS does not archive classes older than Java 6 (major version 50)
+        if (_ids.find(key) == _ids.end() && (source.major_version == 0 || source.major_version >= 50)) {
+            int id = (int) _ids.size();
+            std::string line = name;
+            appendf(line, " id: %d", id);
+
+            if (custom) {
+                line += custom_class_info(jvmti, env, klass, source);
+            }
+            if (!custom || line.find(" source: ") != std::string::npos) {
+                _ids[key] = id;
+                _lines.push_back(line);
+            }
+        }
+
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    // super, interfaces and source; empty if the class cannot be listed
+    std::string custom_class_info(jvmtiEnv* jvmti, JNIEnv* env, jclass klass, const ClassSource& source) {
+        std::string info;
+        jclass super = env->GetSuperclass(klass);
+        int super_id = super == NULL ? -1 : class_id(jvmti, env, super);
+        if (super_id < 0 || source.source.empty()) {
+            return info;
+        }
+        appendf(info, " super: %d", super_id);
+
+        jint count = 0;
+        jclass* interfaces = NULL;
+        if (jvmti->GetImplementedInterfaces(klass, &count, &interfaces) == 0 && count > 0) {
+            info += " interfaces:";
+            for (jint i = 0; i < count; i++) {
+                int id = class_id(jvmti, env, interfaces[i]);
+                if (id < 0) {
+                    info.clear();
+                    break;
+                }
+                appendf(info, " %d", id);
+            }
+        }
+        jvmti->Deallocate((unsigned char*) interfaces);
+
+        if (!info.empty()) {
+            info += " source: " + source.source;
+        }
+        return info;
+    }
+
+    void write() {
+        FILE* f = fopen(file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "vmtrace: cannot create %s\n", file);
+            return;
+        }
+
+        fprintf(f, "# Class list recorded by vmtrace: %d classes\n", (int) _lines.size());
+        for (size_t i = 0; i < _lines.size(); i++) {
+            fprintf(f, "%s\n", _lines[i].c_str());
+        }
+        fclose(f);
+    }
+};
+
+static ClassListRecorder class_list;
+
+// Inlining trees decoded from HotSpot compile_info records. Each PC descriptor holds
+// the stack of inlined frames at that PC, innermost first; together they form the tree.
+// The latest tree of every compiled method is written at VM exit, so trees of two runs can be diffed.
+
+struct InlineNode {
+    unsigned long long names;  // holder id << 32 | name id
+    int bci;                   // call site in the parent method
+    std::vector<InlineNode> children;
+
+    InlineNode* child(unsigned long long child_names, int child_bci) {
+        for (size_t i = 0; i < children.size(); i++) {
+            if (children[i].names == child_names && children[i].bci == child_bci) {
+                return &children[i];
+            }
+        }
+        InlineNode node = {child_names, child_bci, std::vector<InlineNode>()};
+        children.push_back(node);
+        return &children.back();
+    }
+
+    int size() const {
+        int count = (int) children.size();
+        for (size_t i = 0; i < children.size(); i++) {
+            count += children[i].size();
+        }
+        return count;
+    }
+};
+
+static bool by_bci(const InlineNode& a, const InlineNode& b) {
+    return a.bci < b.bci;
+}
+
+struct InlineTree {
+    int compiles;
+    int max_inlined;  // the largest tree seen, to spot methods that lost inlining
+    InlineNode root;
+};
+
+class InliningRecorder {
+  private:
+    jrawMonitorID _lock;
+    std::map<jmethodID, InlineTree> _trees;
+
+    static unsigned long long method_names(jvmtiEnv* jvmti, jmethodID method);
+
+    static std::string method_name(unsigned long long names) {
+        return std::string(lookup_string((unsigned int) (names >> 32))) + "." + lookup_string((unsigned int) names);
+    }
+
+    static void write_node(FILE* f, InlineNode& node, int depth) {
+        std::sort(node.children.begin(), node.children.end(), by_bci);
+        for (size_t i = 0; i < node.children.size(); i++) {
+            fprintf(f, "%*s@%d %s\n", depth * 2, "", node.children[i].bci, method_name(node.children[i].names).c_str());
+            write_node(f, node.children[i], depth + 1);
+        }
+    }
+
+  public:
+    const char* file;
+
+    InliningRecorder() : file(NULL) {
+    }
+
+    void init(jvmtiEnv* jvmti) {
+        jvmti->CreateRawMonitor("inlining_lock", &_lock);
+    }
+
+    void record(jvmtiEnv* jvmti, jmethodID method, const void* compile_info) {
+        InlineNode root = {method_names(jvmti, method), -1, std::vector<InlineNode>()};
+
+        const jvmtiCompiledMethodLoadRecordHeader* header = (const jvmtiCompiledMethodLoadRecordHeader*) compile_info;
+        for (; header != NULL; header = header->next) {
+            if (header->kind != JVMTI_CMLR_INLINE_INFO || header->majorinfoversion != JVMTI_CMLR_MAJOR_VERSION_1) {
+                continue;
+            }
+
+            const jvmtiCompiledMethodLoadInlineRecord* record = (const jvmtiCompiledMethodLoadInlineRecord*) header;
+            for (jint i = 0; i < record->numpcs; i++) {
+                const PCStackInfo* pc = &record->pcinfo[i];
+                // methods[numstackframes - 1] is the compiled method itself
+                InlineNode* node = &root;
+                for (jint frame = pc->numstackframes - 2; frame >= 0; frame--) {
+                    node = node->child(method_names(jvmti, pc->methods[frame]), pc->bcis[frame + 1]);
+                }
+            }
+        }
+
+        jvmti->RawMonitorEnter(_lock);
+        InlineTree& tree = _trees[method];
+        tree.compiles++;
+        tree.root = root;
+        int inlined = root.size();
+        tree.max_inlined = inlined > tree.max_inlined ? inlined : tree.max_inlined;
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    void write(jvmtiEnv* jvmti) {
+        FILE* f = fopen(file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "vmtrace: cannot create %s\n", file);
+            return;
+        }
+
+        jvmti->RawMonitorEnter(_lock);
+
+        // Sorted by name rather than by jmethodID for stable output
+        std::map<std::string, InlineTree*> sorted;
+        for (std::map<jmethodID, InlineTree>::iterator it = _trees.begin(); it != _trees.end(); ++it) {
+            sorted[method_name(it->second.root.names)] = &it->second;
+        }
+
+        fprintf(f, "# Inlining trees recorded by vmtrace: %d methods\n", (int) sorted.size());
+        for (std::map<std::string, InlineTree*>::iterator it = sorted.begin(); it != sorted.end(); ++it) {
+            InlineTree* tree = it->second;
+            int inlined = tree->root.size();
+            fprintf(f, "%s  compiles: %d  inlined: %d", it->first.c_str(), tree->compiles, inlined);
+            if (inlined < tree->max_inlined) {
+                fprintf(f, " (max %d)", tree->max_inlined);
+            }
+            fprintf(f, "\n");
+            write_node(f, tree->root, 1);
+        }
+
+        jvmti->RawMonitorExit(_lock);
+        fclose(f);
+    }
+};
+
+unsigned long long InliningRecorder::method_names(jvmtiEnv* jvmti, jmethodID method) {
+    unsigned int holder, name;
+    methods.lookup(jvmti, method, &holder, &name);
+    return (unsigned long long) holder << 32 | name;
+}
+
+static InliningRecorder inlining;
+
+// Interned class name cached in the class tag, so that hot callbacks do not create strings
+static unsigned int class_name_id(jvmtiEnv* jvmti, jclass klass) {
+    jlong tag = 0;
+    if (jvmti->GetTag(klass, &tag) == 0 && tag != 0) {
+        return (unsigned int) tag;
+    }
+
+    ClassName cn(jvmti, klass);
+    unsigned int id = strings.intern(cn.name());
+    if (id != 0) {
+        jvmti->SetTag(klass, id);
+    }
+    return id;
+}
+
+// Random sampling of one of n events with a per-thread xorshift generator:
+// no shared state, and no bias between different kinds of events in the same thread
+static thread_local unsigned int sample_random = 0;
+
+static bool sampled(unsigned int n) {
+    if (n <= 1) {
+        return true;
+    }
+    unsigned int x = sample_random != 0 ? sample_random : (unsigned int) (uintptr_t) &sample_random | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    sample_random = x;
+    return x % n == 0;
+}
+
+// Monitor contention profiler: time spent entering contended monitors and in Object.wait(),
+// aggregated by monitor class and stack trace. Each thread owns a counting table,
+// so recording needs no locks; the writer thread sums the tables once per interval.
+// A table starts small, and when it is full, a twice larger one is chained to it,
+// so that thousands of threads with a few contended sites each take little memory.
+
+enum ContentionKind {
+    CONTENDED_ENTER,
+    MONITOR_WAIT
+};
+
+struct ContentionSite {
+    std::atomic<unsigned long long> key;  // hash of kind, class and frames; 0 = empty slot
+    int kind;
+    unsigned int class_id;
+    int num_frames;
+    unsigned long long frames[CONTENTION_FRAMES];  // method names as in MethodCache
+    int bcis[CONTENTION_FRAMES];
+    std::atomic<unsigned long long> count;
+    std::atomic<unsigned long long> time;
+    std::atomic<unsigned long long> max;
+};
+
+struct ContentionTable {
+    ContentionTable* next;                   // the list of all per-thread tables
+    std::atomic<ContentionTable*> overflow;  // chained by the owner thread when this table is full
+    std::atomic<bool> in_use;
+    std::atomic<unsigned long long> dropped;  // all tables of the thread were full
+    unsigned int size;                        // power of 2
+    ContentionSite sites[1];
+};
+
+static ContentionTable* new_contention_table(unsigned int size) {
+    ContentionTable* t = (ContentionTable*) calloc(1, sizeof(ContentionTable) + (size - 1) * sizeof(ContentionSite));
+    t->size = size;
+    return t;
+}
+
+struct ContentionTotal {
+    const ContentionSite* site;
+    unsigned long long count;
+    unsigned long long time;
+    unsigned long long max;
+};
+
+static bool by_time(const ContentionTotal& a, const ContentionTotal& b) {
+    return a.time > b.time;
+}
+
+static thread_local ContentionTable* contention_table = NULL;
+static thread_local jlong contention_start = 0;
+
+class ContentionProfiler {
+  private:
+    std::atomic<ContentionTable*> _tables;
+
+    // Tables of finished threads are reused by new threads, since sites do not depend on a thread
+    ContentionTable* acquire_table() {
+        for (ContentionTable* t = _tables.load(std::memory_order_acquire); t != NULL; t = t->next) {
+            bool free = false;
+            if (t->in_use.compare_exchange_strong(free, true)) {
+                return t;
+            }
+        }
+
+        ContentionTable* t = new_contention_table(CONTENTION_INITIAL_SITES);
+        t->in_use.store(true, std::memory_order_relaxed);
+        ContentionTable* head = _tables.load(std::memory_order_relaxed);
+        do {
+            t->next = head;
+        } while (!_tables.compare_exchange_weak(head, t, std::memory_order_release));
+        return t;
+    }
+
+    static void add(std::map<unsigned long long, ContentionTotal>& totals, unsigned long long key,
+                    const ContentionSite* site, unsigned long long count, unsigned long long time,
+                    unsigned long long max) {
+        std::map<unsigned long long, ContentionTotal>::iterator it = totals.find(key);
+        if (it == totals.end()) {
+            ContentionTotal total = {site, count, time, max};
+            totals[key] = total;
+        } else {
+            it->second.count += count;
+            it->second.time += time;
+            it->second.max = max > it->second.max ? max : it->second.max;
+        }
+    }
+
+    static void append_totals(std::string& out, std::vector<ContentionTotal>& totals, bool stacks) {
+        size_t count = totals.size() < CONTENTION_TOP ? totals.size() : CONTENTION_TOP;
+        std::partial_sort(totals.begin(), totals.begin() + count, totals.end(), by_time);
+
+        for (size_t i = 0; i < count; i++) {
+            const ContentionSite* site = totals[i].site;
+            appendf(out, "\n  %10.3f ms  %8llu %s  max %.3f ms  %s", totals[i].time / 1000000.0, totals[i].count,
+                    site->kind == CONTENDED_ENTER ? "enters" : "waits ", totals[i].max / 1000000.0,
+                    lookup_string(site->class_id));
+            for (int f = 0; stacks && f < site->num_frames; f++) {
+                appendf(out, "\n        %s.%s @%d", lookup_string((unsigned int) (site->frames[f] >> 32)),
+                        lookup_string((unsigned int) site->frames[f]), site->bcis[f]);
+            }
+        }
+    }
+
+  public:
+    jlong interval;       // ns between reports, 0 = disabled
+    unsigned int sample;  // record one of every N contentions
+
+    ContentionProfiler() : _tables(NULL), interval(0), sample(1) {
+    }
+
+    void start() {
+        contention_start = sampled(sample) ? Clock::now() : 0;
+    }
+
+    void finish(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, int kind) {
+        if (contention_start == 0) {
+            return;
+        }
+        unsigned long long time = Clock::now() - contention_start;
+        contention_start = 0;
+
+        unsigned int class_id = class_name_id(jvmti, env->GetObjectClass(object));
+        jvmtiFrameInfo frames[CONTENTION_FRAMES];
+        jint num_frames = 0;
+        jvmti->GetStackTrace(thread, 0, CONTENTION_FRAMES, frames, &num_frames);
+
+        unsigned long long key = (unsigned long long) class_id * 0x9e3779b97f4a7c15ULL + kind + 1;
+        for (jint i = 0; i < num_frames; i++) {
+            key = (key ^ (uintptr_t) frames[i].method) * 0x100000001b3ULL + frames[i].location;
+        }
+        // Mix the high bits used for slot index, small tables would otherwise collide on them
+        key = (key ^ (key >> 33)) * 0xff51afd7ed558ccdULL;
+        key ^= key >> 33;
+        key |= 1;
+
+        if (contention_table == NULL) {
+            contention_table = acquire_table();
+        }
+
+        // Only the owner thread inserts, so a slot or a table is published with a plain release store
+        unsigned int total_size = 0;
+        for (ContentionTable* t = contention_table; ; ) {
+            for (unsigned int i = (unsigned int) (key >> 32), probes = 0; probes < CONTENTION_PROBES; i++, probes++) {
+                ContentionSite* site = &t->sites[i & (t->size - 1)];
+                unsigned long long site_key = site->key.load(std::memory_order_relaxed);
+                if (site_key == 0) {
+                    site->kind = kind;
+                    site->class_id = class_id;
+                    site->num_frames = num_frames;
+                    for (jint f = 0; f < num_frames; f++) {
+                        unsigned int holder, name;
+                        methods.lookup(jvmti, frames[f].method, &holder, &name);
+                        site->frames[f] = (unsigned long long) holder << 32 | name;
+                        site->bcis[f] = (int) frames[f].location;
+                    }
+                    site->key.store(key, std::memory_order_release);
+                } else if (site_key != key) {
+                    continue;
+                }
+
+                site->count.fetch_add(1, std::memory_order_relaxed);
+                site->time.fetch_add(time, std::memory_order_relaxed);
+                if (time > site->max.load(std::memory_order_relaxed)) {
+                    site->max.store(time, std::memory_order_relaxed);
+                }
+                return;
+            }
+
+            total_size += t->size;
+            ContentionTable* next = t->overflow.load(std::memory_order_relaxed);
+            if (next == NULL) {
+                if (total_size + t->size * 2 > CONTENTION_SITES) {
+                    contention_table->dropped.fetch_add(1, std::memory_order_relaxed);
+                    return;
+                }
+                next = new_contention_table(t->size * 2);
+                t->overflow.store(next, std::memory_order_release);
+            }
+            t = next;
+        }
+    }
+
+    void thread_ended() {
+        if (contention_table != NULL) {
+            contention_table->in_use.store(false, std::memory_order_release);
+            contention_table = NULL;
+        }
+    }
+
+    // Sums and resets counters of all threads; returns an empty string if there was no contention
+    void report(std::string& out) {
+        std::map<unsigned long long, ContentionTotal> by_site;
+        std::map<unsigned long long, ContentionTotal> by_class;
+        unsigned long long enters = 0, enter_time = 0, waits = 0, wait_time = 0, dropped = 0;
+
+        for (ContentionTable* head = _tables.load(std::memory_order_acquire); head != NULL; head = head->next) {
+            dropped += head->dropped.exchange(0, std::memory_order_relaxed);
+            for (ContentionTable* t = head; t != NULL; t = t->overflow.load(std::memory_order_acquire)) {
+                for (unsigned int i = 0; i < t->size; i++) {
+                    ContentionSite* site = &t->sites[i];
+                    unsigned long long key = site->key.load(std::memory_order_acquire);
+                    if (key == 0 || site->count.load(std::memory_order_relaxed) == 0) {
+                        continue;
+                    }
+
+                    unsigned long long count = site->count.exchange(0, std::memory_order_relaxed);
+                    unsigned long long time = site->time.exchange(0, std::memory_order_relaxed);
+                    unsigned long long max = site->max.exchange(0, std::memory_order_relaxed);
+                    add(by_site, key, site, count, time, max);
+                    add(by_class, (unsigned long long) site->class_id << 1 | site->kind, site, count, time, max);
+
+                    if (site->kind == CONTENDED_ENTER) {
+                        enters += count;
+                        enter_time += time;
+                    } else {
+                        waits += count;
+                        wait_time += time;
+                    }
+                }
+            }
+        }
+
+        if (enters + waits == 0) {
+            return;
+        }
+
+        appendf(out, "Monitor contention: %llu enters (%.3f ms), %llu waits (%.3f ms)",
+                enters, enter_time / 1000000.0, waits, wait_time / 1000000.0);
+        if (sample > 1) {
+            appendf(out, ", sampled 1/%u", sample);
+        }
+        if (dropped > 0) {
+            appendf(out, ", %llu dropped", dropped);
+        }
+
+        std::vector<ContentionTotal> classes, sites;
+        for (std::map<unsigned long long, ContentionTotal>::iterator it = by_class.begin(); it != by_class.end(); ++it) {
+            classes.push_back(it->second);
+        }
+        for (std::map<unsigned long long, ContentionTotal>::iterator it = by_site.begin(); it != by_site.end(); ++it) {
+            sites.push_back(it->second);
+        }
+
+        out += "\nBy monitor class:";
+        append_totals(out, classes, false);
+        out += "\nTop stacks:";
+        append_totals(out, sites, true);
+    }
+};
+
+static ContentionProfiler contention;
+
+// Exception throw profiler: counts throws by (exception class, method, bci) in a shared
+// lock-free table. The callback only does atomic updates: method names are resolved
+// by the writer thread, and class names are interned once per class via the class tag.
+
+struct ThrowSite {
+    std::atomic<unsigned long long> key;  // hash of class, method and bci; 0 = empty slot
+    std::atomic<jmethodID> method;        // set after the key, NULL until the site is complete
+    unsigned int class_id;
+    int bci;
+    std::atomic<unsigned long long> count;
+    std::atomic<bool> stack_busy;
+    int num_frames;
+    jvmtiFrameInfo frames[EXCEPTION_FRAMES];  // the latest sampled stack
+};
+
+struct ThrowTotal {
+    ThrowSite* site;
+    unsigned long long count;
+};
+
+static bool by_count(const ThrowTotal& a, const ThrowTotal& b) {
+    return a.count > b.count;
+}
+
+class ExceptionProfiler {
+  private:
+    ThrowSite _sites[EXCEPTION_SITES];
+    std::atomic<unsigned long long> _dropped;
+    jlong _last_report;
+
+    ThrowSite* find(unsigned int class_id, jmethodID method, int bci) {
+        unsigned long long key = ((unsigned long long) class_id * 0x9e3779b97f4a7c15ULL ^ (uintptr_t) method)
+                                 * 0x100000001b3ULL + bci;
+        key |= 1;
+
+        for (unsigned int i = (unsigned int) (key >> 32), probes = 0; probes < EXCEPTION_SITES; i++, probes++) {
+            ThrowSite* site = &_sites[i & (EXCEPTION_SITES - 1)];
+            unsigned long long site_key = site->key.load(std::memory_order_acquire);
+            if (site_key == key) {
+                return site;
+            } else if (site_key == 0) {
+                if (site->key.compare_exchange_strong(site_key, key)) {
+                    site->class_id = class_id;
+                    site->bci = bci;
+                    site->method.store(method, std::memory_order_release);
+                    return site;
+                } else if (site_key == key) {
+                    return site;
+                }
+            }
+        }
+        return NULL;
+    }
+
+    static void append_frame(std::string& out, jvmtiEnv* jvmti, jmethodID method, int bci) {
+        unsigned int holder, name;
+        methods.lookup(jvmti, method, &holder, &name);
+        appendf(out, "%s.%s @%d", lookup_string(holder), lookup_string(name), bci);
+    }
+
+  public:
+    jlong interval;       // ns between reports, 0 = disabled
+    unsigned int sample;  // record a stack trace for one of N throws, 0 = never
+
+    ExceptionProfiler() : _dropped(0), _last_report(0), interval(0), sample(0) {
+    }
+
+    void thrown(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jmethodID method, jlocation location, jobject exception) {
+        unsigned int class_id = class_name_id(jvmti, env->GetObjectClass(exception));
+        ThrowSite* site = find(class_id, method, (int) location);
+        if (site == NULL) {
+            _dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        site->count.fetch_add(1, std::memory_order_relaxed);
+
+        if (sample > 0 && sampled(sample)) {
+            bool busy = false;
+            if (site->stack_busy.compare_exchange_strong(busy, true, std::memory_order_acquire)) {
+                jint num_frames = 0;
+                jvmti->GetStackTrace(thread, 0, EXCEPTION_FRAMES, site->frames, &num_frames);
+                site->num_frames = num_frames;
+                site->stack_busy.store(false, std::memory_order_release);
+            }
+        }
+    }
+
+    // Throw counts and rates since the previous report; resets the counters
+    void report(jvmtiEnv* jvmti, std::string& out) {
+        jlong now = Clock::now();
+        double seconds = (now - (_last_report != 0 ? _last_report : start_time)) / 1000000000.0;
+        _last_report = now;
+
+        std::vector<ThrowTotal> totals;
+        unsigned long long total = 0;
+        for (int i = 0; i < EXCEPTION_SITES; i++) {
+            ThrowSite* site = &_sites[i];
+            if (site->method.load(std::memory_order_acquire) == NULL || site->count.load(std::memory_order_relaxed) == 0) {
+                continue;
+            }
+            ThrowTotal t = {site, site->count.exchange(0, std::memory_order_relaxed)};
+            totals.push_back(t);
+            total += t.count;
+        }
+
+        unsigned long long dropped = _dropped.exchange(0, std::memory_order_relaxed);
+        if (total + dropped == 0) {
+            return;
+        }
+
+        appendf(out, "Exceptions: %llu thrown (%.1f/s)", total + dropped, (total + dropped) / seconds);
+        if (dropped > 0) {
+            appendf(out, ", %llu at untracked sites", dropped);
+        }
+
+        size_t count = totals.size() < EXCEPTION_TOP ? totals.size() : EXCEPTION_TOP;
+        std::partial_sort(totals.begin(), totals.begin() + count, totals.end(), by_count);
+
+        out += "\nTop throw sites:";
+        for (size_t i = 0; i < count; i++) {
+            ThrowSite* site = totals[i].site;
+            appendf(out, "\n  %10llu  %10.1f/s  %s at ", totals[i].count, totals[i].count / seconds,
+                    lookup_string(site->class_id));
+            append_frame(out, jvmti, site->method.load(std::memory_order_relaxed), site->bci);
+
+            bool busy = false;
+            if (site->num_frames > 1 && site->stack_busy.compare_exchange_strong(busy, true, std::memory_order_acquire)) {
+                // The first frame is the throw site itself
+                for (int f = 1; f < site->num_frames; f++) {
+                    out += "\n        ";
+                    append_frame(out, jvmti, site->frames[f].method, (int) site->frames[f].location);
+                }
+                site->stack_busy.store(false, std::memory_order_release);
+            }
+        }
+    }
+};
+
+static ExceptionProfiler exceptions;
+
+static void write_exception_report(jvmtiEnv* jvmti) {
+    std::string report;
+    exceptions.report(jvmti, report);
+    if (!report.empty()) {
+        writer.put_report(Clock::now() - start_time, report.c_str());
+        writer.flush();
+    }
+}
+
+static void write_contention_report() {
+    std::string report;
+    contention.report(report);
+    if (!report.empty()) {
+        writer.put_report(Clock::now() - start_time, report.c_str());
+        writer.flush();
+    }
+}
+
+// Per-thread CPU time sampled by the writer thread. Live threads are kept in a registry
+// of global references maintained by ThreadStart and ThreadEnd. The arrays are reused
+// between samples, so sampling does not allocate even with thousands of threads.
+
+struct ThreadEntry {
+    jthread thread;      // global reference
+    unsigned int name;
+    unsigned int group;  // thread name with numbers replaced by '#', e.g. pool-#-thread-#
+    jlong cpu_time;      // at the previous sample
+    size_t index;        // in ThreadCpuSampler::_threads
+};
+
+struct ThreadCpu {
+    unsigned int name;
+    unsigned int group;
+    unsigned int count;  // threads in the group
+    jlong time;
+};
+
+static bool by_cpu_time(const ThreadCpu& a, const ThreadCpu& b) {
+    return a.time > b.time;
+}
+
+static bool by_group(const ThreadCpu& a, const ThreadCpu& b) {
+    return a.group < b.group;
+}
+
+class ThreadCpuSampler {
+  private:
+    jrawMonitorID _lock;
+    std::vector<ThreadEntry*> _threads;
+    std::vector<ThreadCpu> _samples;  // CPU time during the interval, including ended threads
+    std::vector<ThreadCpu> _groups;
+    jlong _last_report;
+
+    static unsigned int group_name(const char* name) {
+        std::string group;
+        for (const char* p = name; *p; p++) {
+            if (*p < '0' || *p > '9') {
+                group += *p;
+            } else if (p == name || p[-1] < '0' || p[-1] > '9') {
+                group += '#';
+            }
+        }
+        return strings.intern(group.c_str());
+    }
+
+    // A registered thread points to its entry through JVMTI thread local storage,
+    // so duplicates and ended threads are found without comparing references
+    void add(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+        ThreadEntry* e = NULL;
+        if (jvmti->GetThreadLocalStorage(thread, (void**) &e) != 0 || e != NULL) {
+            return;
+        }
+
+        ThreadName tn(jvmti, thread);
+        const char* name = tn.name() != NULL ? tn.name() : "(unnamed)";
+        e = new ThreadEntry();
+        e->name = strings.intern(name);
+        e->group = group_name(name);
+        e->index = _threads.size();
+        if (jvmti->SetThreadLocalStorage(thread, e) != 0) {
+            // The thread has ended in the meantime
+            delete e;
+            return;
+        }
+        e->thread = (jthread) env->NewGlobalRef(thread);
+        jvmti->GetThreadCpuTime(thread, &e->cpu_time);
+        _threads.push_back(e);
+    }
+
+    void remove(JNIEnv* env, ThreadEntry* e) {
+        env->DeleteGlobalRef(e->thread);
+        _threads[e->index] = _threads.back();
+        _threads[e->index]->index = e->index;
+        _threads.pop_back();
+        delete e;
+    }
+
+    void append_top(std::string& out, std::vector<ThreadCpu>& v, double seconds, bool groups) {
+        size_t count = v.size() < THREAD_CPU_TOP ? v.size() : THREAD_CPU_TOP;
+        std::partial_sort(v.begin(), v.begin() + count, v.end(), by_cpu_time);
+        for (size_t i = 0; i < count && v[i].time > 0; i++) {
+            appendf(out, "\n  %10.1f ms  %5.1f%%  %s", v[i].time / 1000000.0,
+                    v[i].time / (seconds * 10000000.0), lookup_string(groups ? v[i].group : v[i].name));
+            if (groups) {
+                appendf(out, " (%u threads)", v[i].count);
+            }
+        }
+    }
+
+  public:
+    jlong interval;  // ns between samples, 0 = disabled
+
+    ThreadCpuSampler() : _lock(NULL), _last_report(0), interval(0) {
+    }
+
+    void init(jvmtiEnv* jvmti) {
+        jvmti->CreateRawMonitor("threadcpu_lock", &_lock);
+    }
+
+    // Registers threads started before ThreadStart events were enabled: at VMInit or on attach
+    void register_live_threads(jvmtiEnv* jvmti, JNIEnv* env) {
+        jint count = 0;
+        jthread* threads = NULL;
+        if (jvmti->GetAllThreads(&count, &threads) != 0) {
+            return;
+        }
+
+        jvmti->RawMonitorEnter(_lock);
+        for (int i = 0; i < count; i++) {
+            add(jvmti, env, threads[i]);
+            env->DeleteLocalRef(threads[i]);
+        }
+        jvmti->RawMonitorExit(_lock);
+
+        jvmti->Deallocate((unsigned char*) threads);
+    }
+
+    void thread_started(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+        jvmti->RawMonitorEnter(_lock);
+        add(jvmti, env, thread);
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    // Keeps CPU time of the ending thread since the last sample
+    void thread_ended(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+        jvmti->RawMonitorEnter(_lock);
+        ThreadEntry* e = NULL;
+        if (jvmti->GetThreadLocalStorage(thread, (void**) &e) == 0 && e != NULL) {
+            jlong cpu_time;
+            if (jvmti->GetThreadCpuTime(thread, &cpu_time) == 0) {
+                ThreadCpu t = {e->name, e->group, 1, cpu_time - e->cpu_time};
+                _samples.push_back(t);
+            }
+            jvmti->SetThreadLocalStorage(thread, NULL);
+            remove(env, e);
+        }
+        jvmti->RawMonitorExit(_lock);
+    }
+
+    // CPU time of top threads and thread groups since the previous report
+    void report(jvmtiEnv* jvmti, std::string& out) {
+        jlong now = Clock::now();
+        double seconds = (now - (_last_report != 0 ? _last_report : start_time)) / 1000000000.0;
+        _last_report = now;
+
+        jvmti->RawMonitorEnter(_lock);
+
+        for (size_t i = 0; i < _threads.size(); i++) {
+            ThreadEntry* e = _threads[i];
+            jlong cpu_time;
+            if (jvmti->GetThreadCpuTime(e->thread, &cpu_time) == 0) {
+                ThreadCpu t = {e->name, e->group, 1, cpu_time - e->cpu_time};
+                _samples.push_back(t);
+                e->cpu_time = cpu_time;
+            }
+        }
+
+        jlong total = 0;
+        std::sort(_samples.begin(), _samples.end(), by_group);
+        for (size_t i = 0; i < _samples.size(); i++) {
+            const ThreadCpu& t = _samples[i];
+            total += t.time;
+            if (!_groups.empty() && _groups.back().group == t.group) {
+                _groups.back().count++;
+                _groups.back().time += t.time;
+            } else {
+                _groups.push_back(t);
+            }
+        }
+
+        appendf(out, "Thread CPU: %.1f ms in %.1f s (%.1f%% of one core), %d live threads",
+                total / 1000000.0, seconds, total / (seconds * 10000000.0), (int) _threads.size());
+        out += "\nTop threads:";
+        append_top(out, _samples, seconds, false);
+        out += "\nTop thread groups:";
+        append_top(out, _groups, seconds, true);
+
+        _samples.clear();
+        _groups.clear();
+
+        jvmti->RawMonitorExit(_lock);
+    }
+};
+
+static ThreadCpuSampler thread_cpu;
+
+// Wall-clock profiler: a sampler thread takes stack traces of all threads with GetAllStackTraces,
+// whatever they are doing, and counts distinct stacks. The thread state is the leaf frame.
+// Stacks are written at VM death in the collapsed format understood by FlameGraph tools;
+// stacks deeper than WALL_FRAMES get a [truncated] root frame.
+
+struct WallStack {
+    unsigned int count;
+    const char* state;
+    bool truncated;                          // deeper than WALL_FRAMES
+    std::vector<jmethodID> methods;          // top frame first
+    std::vector<unsigned long long> frames;  // method names as in MethodCache
+};
+
+static const char* wall_state(jint state) {
+    if (state & JVMTI_THREAD_STATE_BLOCKED_ON_MONITOR_ENTER) {
+        return "BLOCKED";
+    } else if (state & JVMTI_THREAD_STATE_WAITING) {
+        return "WAITING";
+    }
+    return "RUNNABLE";
+}
+
+class WallClockSampler {
+  private:
+    jrawMonitorID _lock;
+    volatile bool _started;
+    volatile bool _stopping;
+    volatile bool _stopped;
+    std::vector<WallStack> _stacks;
+    std::unordered_map<unsigned long long, size_t> _index;  // stack hash -> _stacks index
+
+    static bool same_stack(const WallStack& stack, const char* state, bool truncated,
+                           const jvmtiFrameInfo* frames, int depth) {
+        if (stack.state != state || stack.truncated != truncated || stack.methods.size() != (size_t) depth) {
+            return false;
+        }
+        for (int i = 0; i < depth; i++) {
+            if (stack.methods[i] != frames[i].method) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Stacks are taken one frame deeper than kept, so that only a stack
+    // with frames beyond WALL_FRAMES is marked as truncated
+    void record(jvmtiEnv* jvmti, const jvmtiStackInfo* info) {
+        const char* state = wall_state(info->state);
+        bool truncated = info->frame_count > WALL_FRAMES;
+        int depth = truncated ? WALL_FRAMES : info->frame_count;
+        const jvmtiFrameInfo* frames = info->frame_buffer;
+
+        unsigned long long key = (uintptr_t) state + truncated;
+        for (int i = 0; i < depth; i++) {
+            key = (key ^ (uintptr_t) frames[i].method) * 0x100000001b3ULL;
+        }
+
+        // Different stacks with the same hash take the next free key
+        std::unordered_map<unsigned long long, size_t>::iterator it;
+        while ((it = _index.find(key)) != _index.end()) {
+            if (same_stack(_stacks[it->second], state, truncated, frames, depth)) {
+                _stacks[it->second].count++;
+                return;
+            }
+            key++;
+        }
+
+        _index[key] = _stacks.size();
+        _stacks.push_back(WallStack());
+        WallStack& stack = _stacks.back();
+        stack.count = 1;
+        stack.state = state;
+        stack.truncated = truncated;
+        stack.methods.resize(depth);
+        stack.frames.resize(depth);
+        for (int i = 0; i < depth; i++) {
+            unsigned int holder, name;
+            methods.lookup(jvmti, frames[i].method, &holder, &name);
+            stack.methods[i] = frames[i].method;
+            stack.frames[i] = (unsigned long long) holder << 32 | name;
+        }
+    }
+
+    void sample(jvmtiEnv* jvmti) {
+        jvmtiStackInfo* info = NULL;
+        jint count = 0;
+        if (jvmti->GetAllStackTraces(WALL_FRAMES + 1, &info, &count) != 0) {
+            return;
+        }
+        for (int i = 0; i < count; i++) {
+            // Agent threads, including this one, have no Java frames
+            if (info[i].frame_count > 0) {
+                record(jvmti, &info[i]);
+            }
+        }
+        jvmti->Deallocate((unsigned char*) info);
+    }
+
+    static void JNICALL run(jvmtiEnv* jvmti, JNIEnv* env, void* arg);
+
+  public:
+    const char* file;
+    jlong interval;  // ms between samples
+
+    WallClockSampler() : _lock(NULL), _started(false), _stopping(false), _stopped(false), file(NULL),
+                         interval(20) {
+    }
+
+    void init(jvmtiEnv* jvmti) {
+        jvmti->CreateRawMonitor("wallclock_lock", &_lock);
+    }
+
+    void start(jvmtiEnv* jvmti, JNIEnv* env) {
+        if (!_started) {
+            _started = run_agent_thread(jvmti, env, "vmtrace sampler", run);
+        }
+    }
+
+    void stop(jvmtiEnv* jvmti) {
+        jvmti->RawMonitorEnter(_lock);
+        _stopping = true;
+        jvmti->RawMonitorNotifyAll(_lock);
+        while (_started && !_stopped) {
+            jvmti->RawMonitorWait(_lock, 0);
+        }
+        jvmti->RawMonitorExit(_lock);
+    }
 
-    char buf[1024];
-    va_list args;
-    va_start(args, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    va_end(args);
+    void write() {
+        FILE* f = fopen(file, "w");
+        if (f == NULL) {
+            fprintf(stderr, "Cannot open wall-clock profile file: %s\n", file);
+            return;
+        }
 
-    jvmti->RawMonitorEnter(vmtrace_lock);
+        for (size_t i = 0; i < _stacks.size(); i++) {
+            const WallStack& stack = _stacks[i];
+            if (stack.truncated) {
+                fprintf(f, "[truncated];");
+            }
+            for (size_t j = stack.frames.size(); j-- > 0; ) {
+                fprintf(f, "%s.%s;", lookup_string((unsigned int) (stack.frames[j] >> 32)),
+                        lookup_string((unsigned int) stack.frames[j]));
+            }
+            fprintf(f, "%s %u\n", stack.state, stack.count);
+        }
+        fclose(f);
+    }
+};
 
-    fprintf(out, "[%.5f] %s\n", (current_time - start_time) / 1000000000.0, buf);
-    
-    jvmti->RawMonitorExit(vmtrace_lock);
+static WallClockSampler wall_clock;
+
+void JNICALL WallClockSampler::run(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    WallClockSampler* self = &wall_clock;
+    jvmti->RawMonitorEnter(self->_lock);
+    while (!self->_stopping) {
+        jvmti->RawMonitorExit(self->_lock);
+        self->sample(jvmti);
+        jvmti->RawMonitorEnter(self->_lock);
+        if (!self->_stopping) {
+            jvmti->RawMonitorWait(self->_lock, self->interval);
+        }
+    }
+    self->_stopped = true;
+    jvmti->RawMonitorNotifyAll(self->_lock);
+    jvmti->RawMonitorExit(self->_lock);
 }
 
-static char* fix_class_name(char* class_name) {
-    // Strip 'L' and ';' from class signature
-    class_name[strlen(class_name) - 1] = 0;
-    return class_name + 1;
+static void write_thread_cpu_report(jvmtiEnv* jvmti) {
+    std::string report;
+    thread_cpu.report(jvmti, report);
+    writer.put_report(Clock::now() - start_time, report.c_str());
+    writer.flush();
 }
 
+// Linux perf integration: /tmp/perf-<pid>.map and jitdump files let perf symbolize
+// JIT compiled frames. Both are written directly from compilation events under perf_lock.
+// Neither format has an unload record: perf takes the latest perf map entry
+// for an address, and orders jitdump entries by timestamps, so a reused code address
+// is resolved to the method loaded there most recently.
 
-class ClassName {
-  private:
-    jvmtiEnv* _jvmti;
-    char* _name;
+static jrawMonitorID perf_lock;
+static bool perf_map_enabled = false;
+static const char* jitdump_dir = NULL;
+static FILE* perf_map = NULL;
+static int jitdump_fd = -1;
 
-  public:
-    ClassName(jvmtiEnv* jvmti, jclass klass) : _jvmti(jvmti), _name(NULL) {
-        _jvmti->GetClassSignature(klass, &_name, NULL);
+#ifdef __linux__
+
+#define JITDUMP_MAGIC 0x4A695444
+#define JITDUMP_VERSION 1
+#define JIT_CODE_LOAD 0
+#define JIT_CODE_DEBUG_INFO 2
+#define JIT_CODE_CLOSE 3
+
+#if defined(__x86_64__)
+#define JITDUMP_ELF_MACH 62   // EM_X86_64
+#elif defined(__aarch64__)
+#define JITDUMP_ELF_MACH 183  // EM_AARCH64
+#elif defined(__i386__)
+#define JITDUMP_ELF_MACH 3    // EM_386
+#else
+#define JITDUMP_ELF_MACH 0
+#endif
+
+struct JitHeader {
+    unsigned int magic;
+    unsigned int version;
+    unsigned int total_size;
+    unsigned int elf_mach;
+    unsigned int pad1;
+    unsigned int pid;
+    unsigned long long timestamp;
+    unsigned long long flags;
+};
+
+struct JitRecordHeader {
+    unsigned int id;
+    unsigned int total_size;
+    unsigned long long timestamp;
+};
+
+struct JitCodeLoad {
+    JitRecordHeader header;
+    unsigned int pid;
+    unsigned int tid;
+    unsigned long long vma;
+    unsigned long long code_addr;
+    unsigned long long code_size;
+    unsigned long long code_index;
+};
+
+struct JitDebugInfo {
+    JitRecordHeader header;
+    unsigned long long code_addr;
+    unsigned long long nr_entry;
+};
+
+struct JitDebugEntry {
+    unsigned long long addr;
+    unsigned int lineno;
+    unsigned int discrim;
+};
+
+static void* jitdump_marker = NULL;
+static unsigned long long jit_code_index = 0;
+
+static void open_perf_map() {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/perf-%d.map", getpid());
+    if ((perf_map = fopen(path, "w")) == NULL) {
+        fprintf(stderr, "vmtrace: cannot create %s\n", path);
     }
+}
 
-    ~ClassName() {
-        _jvmti->Deallocate((unsigned char*) _name);
+static void open_jitdump(const char* dir) {
+    char path[1024];
+    snprintf(path, sizeof(path), "%s/jit-%d.dump", dir, getpid());
+    if ((jitdump_fd = open(path, O_CREAT | O_TRUNC | O_RDWR, 0644)) == -1) {
+        fprintf(stderr, "vmtrace: cannot create %s\n", path);
+        return;
     }
 
-    char* name() {
-        return _name == NULL ? NULL : fix_class_name(_name);
+    // perf record detects jitdump files by the executable mapping of the file
+    jitdump_marker = mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_EXEC, MAP_PRIVATE, jitdump_fd, 0);
+    if (jitdump_marker == MAP_FAILED) {
+        jitdump_marker = NULL;
     }
-};
 
-class MethodName {
-  private:
-    jvmtiEnv* _jvmti;
-    char* _holder_name;
-    char* _method_name;
+    JitHeader header = {JITDUMP_MAGIC, JITDUMP_VERSION, sizeof(JitHeader), JITDUMP_ELF_MACH,
+                        0, (unsigned int) getpid(), (unsigned long long) Clock::monotonic_time(), 0};
+    if (write(jitdump_fd, &header, sizeof(header)) != sizeof(header)) {
+        close(jitdump_fd);
+        jitdump_fd = -1;
+    }
+}
 
-  public:
-    MethodName(jvmtiEnv* jvmti, jmethodID method) : _jvmti(jvmti),
-                                                    _holder_name(NULL),
-                                                    _method_name(NULL) {
-        jclass holder;
-        if (_jvmti->GetMethodDeclaringClass(method, &holder) == 0) {
-            _jvmti->GetClassSignature(holder, &_holder_name, NULL);
-            _jvmti->GetMethodName(method, &_method_name, NULL, NULL);
+static void close_perf_files() {
+    if (perf_map != NULL) {
+        fclose(perf_map);
+        perf_map = NULL;
+    }
+    if (jitdump_fd != -1) {
+        JitRecordHeader close_record = {JIT_CODE_CLOSE, sizeof(JitRecordHeader),
+                                        (unsigned long long) Clock::monotonic_time()};
+        if (write(jitdump_fd, &close_record, sizeof(close_record)) != sizeof(close_record)) {
+            // nothing to do
+        }
+        if (jitdump_marker != NULL) {
+            munmap(jitdump_marker, sysconf(_SC_PAGESIZE));
+        }
+        close(jitdump_fd);
+        jitdump_fd = -1;
+    }
+}
+
+static int line_number(const jvmtiLineNumberEntry* table, jint table_size, jlocation bci) {
+    int line = 0;
+    jlocation best = -1;
+    for (jint i = 0; i < table_size; i++) {
+        if (table[i].start_location <= bci && table[i].start_location > best) {
+            line = table[i].line_number;
+            best = table[i].start_location;
         }
     }
+    return line;
+}
 
-    ~MethodName() {
-        _jvmti->Deallocate((unsigned char*) _method_name);
-        _jvmti->Deallocate((unsigned char*) _holder_name);
+// Debug info record maps code addresses to source lines; must precede the code load record
+static void write_jitdump_debug_info(jvmtiEnv* jvmti, jmethodID method, const char* holder,
+                                     const void* code_addr, jint map_length, const jvmtiAddrLocationMap* map) {
+    jclass holder_class;
+    char* source_file = NULL;
+    jvmtiLineNumberEntry* table = NULL;
+    jint table_size = 0;
+    if (jvmti->GetMethodDeclaringClass(method, &holder_class) != 0 ||
+        jvmti->GetSourceFileName(holder_class, &source_file) != 0 ||
+        jvmti->GetLineNumberTable(method, &table_size, &table) != 0) {
+        jvmti->Deallocate((unsigned char*) source_file);
+        return;
     }
 
-    char* holder() {
-        return _holder_name == NULL ? NULL : fix_class_name(_holder_name);
+    // Source path is the package directory of the holder class plus the source file name
+    char file_name[1024];
+    const char* package_end = strrchr(holder, '/');
+    int package_len = package_end == NULL ? 0 : (int) (package_end - holder + 1);
+    int name_len = snprintf(file_name, sizeof(file_name), "%.*s%s", package_len, holder, source_file);
+    size_t name_size = (name_len < (int) sizeof(file_name) ? name_len : sizeof(file_name) - 1) + 1;
+
+    size_t entry_size = sizeof(JitDebugEntry) + name_size;
+    size_t total_size = sizeof(JitDebugInfo) + map_length * entry_size;
+    char* buf = (char*) malloc(total_size);
+
+    JitDebugInfo* info = (JitDebugInfo*) buf;
+    info->header.id = JIT_CODE_DEBUG_INFO;
+    info->header.total_size = (unsigned int) total_size;
+    info->header.timestamp = Clock::monotonic_time();
+    info->code_addr = (uintptr_t) code_addr;
+    info->nr_entry = map_length;
+
+    char* p = buf + sizeof(JitDebugInfo);
+    for (jint i = 0; i < map_length; i++, p += entry_size) {
+        JitDebugEntry entry = {(uintptr_t) map[i].start_address,
+                               (unsigned int) line_number(table, table_size, map[i].location), 0};
+        memcpy(p, &entry, sizeof(entry));
+        memcpy(p + sizeof(entry), file_name, name_size);
     }
 
-    char* name() {
-        return _method_name;
+    if (write(jitdump_fd, buf, total_size) != (ssize_t) total_size) {
+        fprintf(stderr, "vmtrace: jitdump write failed\n");
     }
-};
 
-class ThreadName {
-  private:
-    jvmtiEnv* _jvmti;
-    char* _name;
+    free(buf);
+    jvmti->Deallocate((unsigned char*) table);
+    jvmti->Deallocate((unsigned char*) source_file);
+}
 
-  public:
-    ThreadName(jvmtiEnv* jvmti, jthread thread) : _jvmti(jvmti), _name(NULL) {
-        jvmtiThreadInfo info;
-        _name = _jvmti->GetThreadInfo(thread, &info) == 0 ? info.name : NULL;
+static void write_jitdump_code_load(const char* name, const void* code_addr, jint code_size) {
+    size_t name_size = strlen(name) + 1;
+    size_t total_size = sizeof(JitCodeLoad) + name_size + code_size;
+    char* buf = (char*) malloc(total_size);
+
+    JitCodeLoad* record = (JitCodeLoad*) buf;
+    record->header.id = JIT_CODE_LOAD;
+    record->header.total_size = (unsigned int) total_size;
+    record->header.timestamp = Clock::monotonic_time();
+    record->pid = (unsigned int) getpid();
+    record->tid = current_tid();
+    record->vma = (uintptr_t) code_addr;
+    record->code_addr = (uintptr_t) code_addr;
+    record->code_size = code_size;
+    record->code_index = jit_code_index++;
+    memcpy(buf + sizeof(JitCodeLoad), name, name_size);
+    memcpy(buf + sizeof(JitCodeLoad) + name_size, code_addr, code_size);
+
+    if (write(jitdump_fd, buf, total_size) != (ssize_t) total_size) {
+        fprintf(stderr, "vmtrace: jitdump write failed\n");
     }
+    free(buf);
+}
 
-    ~ThreadName() {
-        _jvmti->Deallocate((unsigned char*) _name);
+static void perf_code_load(jvmtiEnv* jvmti, const char* name, jmethodID method, const char* holder,
+                           const void* code_addr, jint code_size,
+                           jint map_length, const jvmtiAddrLocationMap* map) {
+    jvmti->RawMonitorEnter(perf_lock);
+
+    if (perf_map != NULL) {
+        fprintf(perf_map, "%lx %x %s\n", (unsigned long) (uintptr_t) code_addr, code_size, name);
+        fflush(perf_map);
     }
 
-    char* name() {
-        return _name;
+    if (jitdump_fd != -1) {
+        if (method != NULL && map_length > 0) {
+            write_jitdump_debug_info(jvmti, method, holder, code_addr, map_length, map);
+        }
+        write_jitdump_code_load(name, code_addr, code_size);
     }
-};
+
+    jvmti->RawMonitorExit(perf_lock);
+}
+
+static void perf_method_load(jvmtiEnv* jvmti, jmethodID method, const void* code_addr, jint code_size,
+                             jint map_length, const jvmtiAddrLocationMap* map) {
+    MethodName mn(jvmti, method);
+    if (mn.holder() == NULL || mn.name() == NULL) {
+        return;
+    }
+
+    char name[1024];
+    snprintf(name, sizeof(name), "%s.%s%s", mn.holder(), mn.name(), mn.signature());
+    perf_code_load(jvmti, name, method, mn.holder(), code_addr, code_size, map_length, map);
+}
+
+#else
+
+static void open_perf_map() {
+    fprintf(stderr, "vmtrace: perfmap is supported only on Linux\n");
+}
+
+static void open_jitdump(const char* dir) {
+    fprintf(stderr, "vmtrace: jitdump is supported only on Linux\n");
+}
+
+static void close_perf_files() {
+}
+
+static void perf_code_load(jvmtiEnv* jvmti, const char* name, jmethodID method, const char* holder,
+                           const void* code_addr, jint code_size,
+                           jint map_length, const jvmtiAddrLocationMap* map) {
+}
+
+static void perf_method_load(jvmtiEnv* jvmti, jmethodID method, const void* code_addr, jint code_size,
+                             jint map_length, const jvmtiAddrLocationMap* map) {
+}
+
+#endif // __linux__
+
+
+// Reports written at VM death, or on demand with DataDumpRequest (SIGQUIT or jcmd)
+static void write_reports(jvmtiEnv* jvmti) {
+    std::string report;
+    if (class_loads.top > 0) {
+        class_loads.report(jvmti, report);
+    }
+    if (code_cache.interval > 0) {
+        code_cache.report(jvmti, report, true);
+    }
+
+    if (!report.empty()) {
+        // Trailing newline is added by the writer
+        report.erase(report.size() - 1);
+        writer.put_report(Clock::now() - start_time, report.c_str());
+        writer.flush();
+    }
+}
+
+static void write_final_output(jvmtiEnv* jvmti) {
+    flush_events();
+    if (stats_mode) {
+        write_stats();
+    }
+    if (gc_pauses_interval > 0) {
+        write_gc_pause_report();
+    }
+    if (strings.overflows() > 0) {
+        char buf[128];
+        snprintf(buf, sizeof(buf), "String table overflow: %llu names were written inline", strings.overflows());
+        writer.put_report(Clock::now() - start_time, buf);
+        writer.flush();
+    }
+    if (contention.interval > 0) {
+        write_contention_report();
+    }
+    if (exceptions.interval > 0) {
+        write_exception_report(jvmti);
+    }
+    if (thread_cpu.interval > 0) {
+        write_thread_cpu_report(jvmti);
+    }
+    write_reports(jvmti);
+}
+
+// Advances the schedule of a periodic report; skips missed periods rather than catching up
+static bool is_due(jlong now, jlong* next, jlong interval) {
+    if (now < *next) {
+        return false;
+    }
+    *next = *next + interval > now ? *next + interval : now + interval;
+    return true;
+}
+
+static void JNICALL writer_thread(jvmtiEnv* jvmti, JNIEnv* env, void* arg) {
+    jlong next_stats = Clock::now() + stats_interval;
+    jlong next_gc_pauses = Clock::now() + gc_pauses_interval;
+    jlong next_code_cache = Clock::now() + code_cache.interval;
+    jlong next_churn = Clock::now() + churn_window;
+    jlong next_contention = Clock::now() + contention.interval;
+    jlong next_exceptions = Clock::now() + exceptions.interval;
+    jlong next_thread_cpu = Clock::now() + thread_cpu.interval;
+
+    if (thread_cpu.interval > 0) {
+        thread_cpu.register_live_threads(jvmti, env);
+    }
+
+    jvmti->RawMonitorEnter(vmtrace_lock);
+    while (!writer_stopping) {
+        jvmti->RawMonitorExit(vmtrace_lock);
+        bool written = flush_events();
+        jlong now = Clock::now();
+        if (stats_mode && is_due(now, &next_stats, stats_interval)) {
+            write_stats();
+        }
+        if (gc_pauses_interval > 0 && is_due(now, &next_gc_pauses, gc_pauses_interval)) {
+            write_gc_pause_report();
+        }
+        if (code_cache.interval > 0 && is_due(now, &next_code_cache, code_cache.interval)) {
+            write_code_cache_summary(jvmti);
+        }
+        if (churn_threshold > 0 && is_due(now, &next_churn, churn_window)) {
+            write_churn_report();
+        }
+        if (contention.interval > 0 && is_due(now, &next_contention, contention.interval)) {
+            write_contention_report();
+        }
+        if (exceptions.interval > 0 && is_due(now, &next_exceptions, exceptions.interval)) {
+            write_exception_report(jvmti);
+        }
+        if (thread_cpu.interval > 0 && is_due(now, &next_thread_cpu, thread_cpu.interval)) {
+            write_thread_cpu_report(jvmti);
+        }
+        if (dump_requested) {
+            dump_requested = false;
+            write_reports(jvmti);
+        }
+        jvmti->RawMonitorEnter(vmtrace_lock);
+
+        if (!written && !writer_stopping) {
+            jvmti->RawMonitorWait(vmtrace_lock, WRITER_IDLE_PERIOD);
+        }
+    }
+    jvmti->RawMonitorExit(vmtrace_lock);
+
+    write_final_output(jvmti);
+
+    jvmti->RawMonitorEnter(vmtrace_lock);
+    writer_stopped = true;
+    jvmti->RawMonitorNotifyAll(vmtrace_lock);
+    jvmti->RawMonitorExit(vmtrace_lock);
+}
+
+static void start_writer_thread(jvmtiEnv* jvmti, JNIEnv* env) {
+    if (writer_started) {
+        return;
+    }
+
+    writer_started = run_agent_thread(jvmti, env, "vmtrace writer", writer_thread);
+}
+
+// Waits until the writer thread writes all pending events
+static void stop_writer_thread(jvmtiEnv* jvmti) {
+    jvmti->RawMonitorEnter(vmtrace_lock);
+    writer_stopping = true;
+    jvmti->RawMonitorNotifyAll(vmtrace_lock);
+    while (writer_started && !writer_stopped) {
+        jvmti->RawMonitorWait(vmtrace_lock, 0);
+    }
+    jvmti->RawMonitorExit(vmtrace_lock);
+
+    if (!writer_started) {
+        write_final_output(jvmti);
+    }
+}
 
 
 void JNICALL VMStart(jvmtiEnv* jvmti, JNIEnv* env) {
-    trace(jvmti, "VM started");
+    class_loads.vm_started();
+    trace(jvmti, EVENT_VM_START);
 }
 
 void JNICALL VMInit(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
-    trace(jvmti, "VM initialized");
+    class_loads.vm_initialized();
+    trace(jvmti, EVENT_VM_INIT);
+    start_writer_thread(jvmti, env);
+    if (wall_clock.file != NULL) {
+        wall_clock.start(jvmti, env);
+    }
 }
 
 void JNICALL VMDeath(jvmtiEnv* jvmti, JNIEnv* env) {
-    trace(jvmti, "VM destroyed");
+    trace(jvmti, EVENT_VM_DEATH);
+    stop_writer_thread(jvmti);
+
+    if (class_list.file != NULL) {
+        class_list.write();
+    }
+    if (inlining.file != NULL) {
+        inlining.write(jvmti);
+    }
+    if (wall_clock.file != NULL) {
+        wall_clock.stop(jvmti);
+        wall_clock.write();
+    }
 }
 
 void JNICALL ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* env,
@@ -135,57 +3328,345 @@ void JNICALL ClassFileLoadHook(jvmtiEnv* jvmti, JNIEnv* env,
                                const char* name, jobject protection_domain,
                                jint data_len, const unsigned char* data,
                                jint* new_data_len, unsigned char** new_data) {
-    trace(jvmti, "Loading class: %s (%d bytes)", name, data_len);
+    if (class_loads.top > 0 && name != NULL && class_being_redefined == NULL) {
+        class_loads.loading(jvmti, name, loader);
+    }
+    if (class_list.file != NULL && name != NULL && class_being_redefined == NULL) {
+        class_list.loading(jvmti, env, name, loader, protection_domain, data_len, data);
+    }
+    counters.add(COUNTER_CLASSES_LOADED, 1);
+    counters.add(COUNTER_CLASS_BYTES, data_len);
+    if (stats_mode) {
+        stats.class_loaded(data_len);
+        return;
+    }
+    trace(jvmti, EVENT_CLASS_LOAD, name, NULL, data_len);
 }
 
 void JNICALL ClassPrepare(jvmtiEnv* jvmti, JNIEnv* env,
                           jthread thread, jclass klass) {
     ClassName cn(jvmti, klass);
-    trace(jvmti, "Class prepared: %s", cn.name());
+    char* name = cn.name();
+    if (name == NULL) {
+        return;
+    }
+
+    if (class_loads.top > 0) {
+        jobject loader;
+        if (jvmti->GetClassLoader(klass, &loader) == 0 && loader != NULL) {
+            ClassName ln(jvmti, env->GetObjectClass(loader));
+            class_loads.prepared(jvmti, name, loader, ln.name());
+        } else {
+            class_loads.prepared(jvmti, name, NULL, NULL);
+        }
+    }
+    if (class_list.file != NULL) {
+        class_list.prepared(jvmti, env, klass, name);
+    }
+
+    if (!stats_mode) {
+        trace(jvmti, EVENT_CLASS_PREPARE, name);
+    }
 }
 
 void JNICALL DynamicCodeGenerated(jvmtiEnv* jvmti, const char* name,
                                   const void* address, jint length) {
-    trace(jvmti, "Dynamic code generated: %s (%d bytes)", name, length);
+    if (!stats_mode) {
+        trace(jvmti, EVENT_DYNAMIC_CODE, name, NULL, length, (uintptr_t) address);
+    }
+    if (code_cache.interval > 0) {
+        code_cache.load(jvmti, address, length, NULL);
+    }
+
+    if (perf_map != NULL || jitdump_fd != -1) {
+        perf_code_load(jvmti, name, NULL, NULL, address, length, 0, NULL);
+    }
+}
+
+// Method names come from MethodCache; names it could not intern are resolved again and passed inline
+static void trace_method(jvmtiEnv* jvmti, int kind, jmethodID method, unsigned int holder, unsigned int name,
+                         unsigned long long arg0 = 0, unsigned long long arg1 = 0) {
+    if (holder != 0 && name != 0) {
+        trace_ids(jvmti, kind, holder, name, arg0, arg1);
+        return;
+    }
+    MethodName mn(jvmti, method);
+    trace(jvmti, kind, mn.holder(), mn.name(), arg0, arg1);
 }
 
 void JNICALL CompiledMethodLoad(jvmtiEnv* jvmti, jmethodID method,
                                 jint code_size, const void* code_addr,
                                 jint map_length, const jvmtiAddrLocationMap* map,
                                 const void* compile_info) {
-    MethodName mn(jvmti, method);
-    trace(jvmti, "Method compiled: %s.%s (%d bytes)", mn.holder(), mn.name(), code_size);
+    unsigned int holder = 0, name = 0;
+    if (!stats_mode || code_cache.interval > 0 || churn_threshold > 0) {
+        methods.lookup(jvmti, method, &holder, &name);
+    }
+    if (churn_threshold > 0) {
+        methods.compiled(method, code_size);
+    }
+    if (inlining.file != NULL) {
+        inlining.record(jvmti, method, compile_info);
+    }
+
+    counters.add(COUNTER_METHODS_COMPILED, 1);
+    counters.add(COUNTER_COMPILED_BYTES, code_size);
+    if (stats_mode) {
+        stats.method_compiled(code_size);
+    } else {
+        trace_method(jvmti, EVENT_METHOD_COMPILED, method, holder, name, code_size, (uintptr_t) code_addr);
+    }
+    if (code_cache.interval > 0) {
+        code_cache.load(jvmti, code_addr, code_size, holder != 0 ? strings.lookup(holder) : "(unknown)");
+    }
+
+    if (perf_map != NULL || jitdump_fd != -1) {
+        perf_method_load(jvmti, method, code_addr, code_size, map_length, map);
+    }
 }
 
 void JNICALL CompiledMethodUnload(jvmtiEnv* jvmti, jmethodID method,
                                   const void* code_addr) {
-    MethodName mn(jvmti, method);
-    trace(jvmti, "Method flushed: %s.%s", mn.holder(), mn.name());
+    if (code_cache.interval > 0) {
+        code_cache.unload(jvmti, code_addr);
+    }
+    if (churn_threshold > 0) {
+        methods.unloaded(method);
+    }
+    counters.add(COUNTER_METHODS_FLUSHED, 1);
+    if (stats_mode) {
+        stats.method_flushed();
+        return;
+    }
+    unsigned int holder, name;
+    methods.lookup(jvmti, method, &holder, &name);
+    trace_method(jvmti, EVENT_METHOD_FLUSHED, method, holder, name, (uintptr_t) code_addr);
 }
 
 void JNICALL ThreadStart(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+    if (thread_cpu.interval > 0) {
+        thread_cpu.thread_started(jvmti, env, thread);
+    }
+    counters.add(COUNTER_THREADS_STARTED, 1);
+    counters.add(COUNTER_THREADS_LIVE, 1);
+    if (stats_mode) {
+        stats.thread_started();
+        return;
+    }
     ThreadName tn(jvmti, thread);
-    trace(jvmti, "Thread started: %s", tn.name());
+    trace(jvmti, EVENT_THREAD_START, tn.name());
 }
 
 void JNICALL ThreadEnd(jvmtiEnv* jvmti, JNIEnv* env, jthread thread) {
+    if (contention.interval > 0) {
+        contention.thread_ended();
+    }
+    if (thread_cpu.interval > 0) {
+        thread_cpu.thread_ended(jvmti, env, thread);
+    }
+    counters.add(COUNTER_THREADS_LIVE, -1);
+    if (stats_mode) {
+        stats.thread_ended();
+        return;
+    }
     ThreadName tn(jvmti, thread);
-    trace(jvmti, "Thread finished: %s", tn.name());
+    trace(jvmti, EVENT_THREAD_END, tn.name());
+}
+
+void JNICALL MonitorContendedEnter(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
+    contention.start();
+}
+
+void JNICALL MonitorContendedEntered(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object) {
+    contention.finish(jvmti, env, thread, object, CONTENDED_ENTER);
+}
+
+void JNICALL MonitorWait(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jlong timeout) {
+    contention.start();
+}
+
+void JNICALL MonitorWaited(jvmtiEnv* jvmti, JNIEnv* env, jthread thread, jobject object, jboolean timed_out) {
+    contention.finish(jvmti, env, thread, object, MONITOR_WAIT);
+}
+
+void JNICALL ExceptionThrown(jvmtiEnv* jvmti, JNIEnv* env, jthread thread,
+                             jmethodID method, jlocation location, jobject exception,
+                             jmethodID catch_method, jlocation catch_location) {
+    exceptions.thrown(jvmti, env, thread, method, location, exception);
+}
+
+void JNICALL DataDumpRequest(jvmtiEnv* jvmti) {
+    jvmti->RawMonitorEnter(vmtrace_lock);
+    dump_requested = true;
+    jvmti->RawMonitorNotifyAll(vmtrace_lock);
+    jvmti->RawMonitorExit(vmtrace_lock);
 }
 
+// GC callbacks must not allocate memory or call JNI: only the ring and atomic counters are touched
 void JNICALL GarbageCollectionStart(jvmtiEnv* jvmti) {
-    trace(jvmti, "GC started");
+    gc_start_time = Clock::now();
+    if (!stats_mode) {
+        trace(jvmti, EVENT_GC_START);
+    }
 }
 
 void JNICALL GarbageCollectionFinish(jvmtiEnv* jvmti) {
-    trace(jvmti, "GC finished");
+    jlong pause = gc_start_time == 0 ? 0 : Clock::now() - gc_start_time;
+    gc_start_time = 0;
+    if (stats_mode) {
+        stats.gc_finished(pause);
+    }
+    if (gc_pauses_interval > 0) {
+        gc_pauses.record(pause);
+    }
+    counters.add(COUNTER_GC_COUNT, 1);
+    counters.add(COUNTER_GC_TIME, pause);
+    counters.update_max(COUNTER_GC_MAX_PAUSE, pause);
+
+    if (!stats_mode) {
+        trace(jvmti, EVENT_GC_FINISH, NULL, NULL, pause);
+    }
+    if (long_gc_pause > 0 && pause >= long_gc_pause) {
+        trace(jvmti, EVENT_LONG_GC_PAUSE, NULL, NULL, pause);
+    }
 }
 
-JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
-    if (options == NULL || !options[0]) {
+// Options: [file][,format=text|binary|chrome][,clock=monotonic][,perfmap][,jitdump[=dir]][,stats[=seconds]][,gchistogram[=seconds]][,gcpause=ms][,classload[=N]][,classlist=file][,codecache[=seconds]][,churn=N[:seconds]][,inlining=file][,contention[=seconds[:N]]][,exceptions[=seconds[:N]]][,threadcpu[=seconds]][,wallclock=file[:ms]][,rotate=MB[:N[:seconds]]][,counters[=file]]
+static const char* parse_options(char* options) {
+    const char* file = NULL;
+    for (char* opt = strtok(options, ","); opt != NULL; opt = strtok(NULL, ",")) {
+        if (strcmp(opt, "clock=monotonic") == 0) {
+            use_tsc = false;
+        } else if (strcmp(opt, "stats") == 0) {
+            stats_mode = true;
+        } else if (strncmp(opt, "stats=", 6) == 0) {
+            stats_mode = true;
+            stats_interval = (jlong) (atof(opt + 6) * 1000000000);
+            if (stats_interval <= 0) {
+                stats_interval = 1000000000;
+            }
+        } else if (strcmp(opt, "classload") == 0) {
+            class_loads.top = 20;
+        } else if (strncmp(opt, "classload=", 10) == 0) {
+            class_loads.top = atoi(opt + 10);
+        } else if (strncmp(opt, "classlist=", 10) == 0) {
+            class_list.file = opt + 10;
+        } else if (strcmp(opt, "codecache") == 0) {
+            code_cache.interval = 10000000000LL;
+        } else if (strncmp(opt, "codecache=", 10) == 0) {
+            code_cache.interval = (jlong) (atof(opt + 10) * 1000000000);
+            if (code_cache.interval <= 0) {
+                code_cache.interval = 10000000000LL;
+            }
+        } else if (strncmp(opt, "churn=", 6) == 0) {
+            churn_threshold = (unsigned int) atoi(opt + 6);
+            const char* window = strchr(opt, ':');
+            if (window != NULL && atof(window + 1) > 0) {
+                churn_window = (jlong) (atof(window + 1) * 1000000000);
+            }
+        } else if (strncmp(opt, "inlining=", 9) == 0) {
+            inlining.file = opt + 9;
+        } else if (strcmp(opt, "contention") == 0) {
+            contention.interval = 10000000000LL;
+        } else if (strncmp(opt, "contention=", 11) == 0) {
+            contention.interval = (jlong) (atof(opt + 11) * 1000000000);
+            if (contention.interval <= 0) {
+                contention.interval = 10000000000LL;
+            }
+            const char* sample = strchr(opt, ':');
+            if (sample != NULL && atoi(sample + 1) > 0) {
+                contention.sample = atoi(sample + 1);
+            }
+        } else if (strcmp(opt, "exceptions") == 0) {
+            exceptions.interval = 10000000000LL;
+        } else if (strncmp(opt, "exceptions=", 11) == 0) {
+            exceptions.interval = (jlong) (atof(opt + 11) * 1000000000);
+            if (exceptions.interval <= 0) {
+                exceptions.interval = 10000000000LL;
+            }
+            const char* sample = strchr(opt, ':');
+            if (sample != NULL) {
+                exceptions.sample = atoi(sample + 1);
+            }
+        } else if (strcmp(opt, "threadcpu") == 0) {
+            thread_cpu.interval = 10000000000LL;
+        } else if (strncmp(opt, "threadcpu=", 10) == 0) {
+            thread_cpu.interval = (jlong) (atof(opt + 10) * 1000000000);
+            if (thread_cpu.interval <= 0) {
+                thread_cpu.interval = 10000000000LL;
+            }
+        } else if (strncmp(opt, "wallclock=", 10) == 0) {
+            char* interval = strchr(opt + 10, ':');
+            if (interval != NULL) {
+                *interval = 0;
+                wall_clock.interval = atoi(interval + 1) > 0 ? atoi(interval + 1) : 20;
+            }
+            wall_clock.file = opt + 10;
+        } else if (strncmp(opt, "rotate=", 7) == 0) {
+            segments.segment_size = (size_t) atoi(opt + 7) * 1024 * 1024;
+            if (segments.segment_size < MIN_SEGMENT_SIZE) {
+                segments.segment_size = MIN_SEGMENT_SIZE;
+            }
+            const char* count = strchr(opt, ':');
+            if (count != NULL) {
+                segments.count = atoi(count + 1) > 0 ? atoi(count + 1) : 1;
+                const char* interval = strchr(count + 1, ':');
+                if (interval != NULL) {
+                    segments.interval = (jlong) (atof(interval + 1) * 1000000000);
+                }
+            }
+        } else if (strcmp(opt, "counters") == 0) {
+            counters_enabled = true;
+        } else if (strncmp(opt, "counters=", 9) == 0) {
+            counters_enabled = true;
+            counters_file = opt + 9;
+        } else if (strcmp(opt, "gchistogram") == 0) {
+            gc_pauses_interval = 10000000000LL;
+        } else if (strncmp(opt, "gchistogram=", 12) == 0) {
+            gc_pauses_interval = (jlong) (atof(opt + 12) * 1000000000);
+            if (gc_pauses_interval <= 0) {
+                gc_pauses_interval = 10000000000LL;
+            }
+        } else if (strncmp(opt, "gcpause=", 8) == 0) {
+            long_gc_pause = (jlong) (atof(opt + 8) * 1000000);
+        } else if (strcmp(opt, "perfmap") == 0) {
+            perf_map_enabled = true;
+        } else if (strcmp(opt, "jitdump") == 0) {
+            jitdump_dir = "/tmp";
+        } else if (strncmp(opt, "jitdump=", 8) == 0) {
+            jitdump_dir = opt + 8;
+        } else if (strncmp(opt, "format=", 7) == 0) {
+            if (strcmp(opt + 7, "binary") == 0) {
+                output_format = FORMAT_BINARY;
+            } else if (strcmp(opt + 7, "chrome") == 0) {
+                output_format = FORMAT_CHROME;
+            } else {
+                output_format = FORMAT_TEXT;
+            }
+        } else if (strncmp(opt, "file=", 5) == 0) {
+            file = opt + 5;
+        } else if (strchr(opt, '=') == NULL) {
+            file = opt;
+        }
+    }
+    return file;
+}
+
+static jint init_agent(JavaVM* vm, char* options, bool attach) {
+    // Option values point into the copy, so it is never freed
+    const char* file = options == NULL ? NULL : parse_options(strdup(options));
+    if (file == NULL || !file[0]) {
+        if (segments.segment_size > 0) {
+            fprintf(stderr, "vmtrace: rotate requires an output file\n");
+            segments.segment_size = 0;
+        }
         out = stderr;
-    } else if ((out = fopen(options, "w")) == NULL) {
-        fprintf(stderr, "Cannot open output file: %s\n", options);
+    } else if (segments.segment_size > 0) {
+        if (!segments.open(file)) {
+            return 1;
+        }
+    } else if ((out = fopen(file, output_format == FORMAT_BINARY ? "wb" : "w")) == NULL) {
+        fprintf(stderr, "Cannot open output file: %s\n", file);
         return 1;
     }
 
@@ -193,14 +3674,46 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     vm->GetEnv((void**) &jvmti, JVMTI_VERSION_1_0);
 
     jvmti->CreateRawMonitor("vmtrace_lock", &vmtrace_lock);
-    jvmti->GetTime(&start_time);
+    jvmti->CreateRawMonitor("perf_lock", &perf_lock);
+    class_loads.init(jvmti);
+    class_list.init(jvmti);
+    code_cache.init(jvmti);
+    inlining.init(jvmti);
+    thread_cpu.init(jvmti);
+    if (counters_enabled) {
+        counters.open(counters_file);
+    }
+    wall_clock.init(jvmti);
+    Clock::init(use_tsc);
+    start_time = Clock::now();
+
+    if (perf_map_enabled) {
+        open_perf_map();
+    }
+    if (jitdump_dir != NULL) {
+        open_jitdump(jitdump_dir);
+    }
 
-    trace(jvmti, "VMTrace started");
+    writer.start();
+    trace(jvmti, EVENT_VMTRACE_STARTED);
 
     jvmtiCapabilities capabilities = {0};
     capabilities.can_generate_all_class_hook_events = 1;
     capabilities.can_generate_compiled_method_load_events = 1;
     capabilities.can_generate_garbage_collection_events = 1;
+    capabilities.can_get_source_file_name = jitdump_dir != NULL;
+    capabilities.can_get_line_numbers = jitdump_dir != NULL;
+    capabilities.can_generate_monitor_events = contention.interval > 0;
+    capabilities.can_tag_objects = contention.interval > 0 || exceptions.interval > 0;
+    capabilities.can_generate_exception_events = exceptions.interval > 0;
+    capabilities.can_get_thread_cpu_time = thread_cpu.interval > 0;
+
+    // In the live phase, not every capability can be added; take what is available
+    jvmtiCapabilities potential = {0};
+    jvmti->GetPotentialCapabilities(&potential);
+    for (size_t i = 0; i < sizeof(capabilities); i++) {
+        ((unsigned char*) &capabilities)[i] &= ((unsigned char*) &potential)[i];
+    }
     jvmti->AddCapabilities(&capabilities);
 
     jvmtiEventCallbacks callbacks = {0};
@@ -216,13 +3729,21 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     callbacks.ThreadEnd = ThreadEnd;
     callbacks.GarbageCollectionStart = GarbageCollectionStart;
     callbacks.GarbageCollectionFinish = GarbageCollectionFinish;
+    callbacks.DataDumpRequest = DataDumpRequest;
+    callbacks.MonitorContendedEnter = MonitorContendedEnter;
+    callbacks.MonitorContendedEntered = MonitorContendedEntered;
+    callbacks.MonitorWait = MonitorWait;
+    callbacks.MonitorWaited = MonitorWaited;
+    callbacks.Exception = ExceptionThrown;
     jvmti->SetEventCallbacks(&callbacks, sizeof(callbacks));
 
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_START, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_INIT, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_VM_DEATH, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_FILE_LOAD_HOOK, NULL);
-    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
+    if (!stats_mode || class_loads.top > 0 || class_list.file != NULL) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_CLASS_PREPARE, NULL);
+    }
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DYNAMIC_CODE_GENERATED, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_LOAD, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_COMPILED_METHOD_UNLOAD, NULL);
@@ -230,12 +3751,61 @@ JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_THREAD_END, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_START, NULL);
     jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_GARBAGE_COLLECTION_FINISH, NULL);
+    jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_DATA_DUMP_REQUEST, NULL);
+    if (contention.interval > 0) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTER, NULL);
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_CONTENDED_ENTERED, NULL);
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAIT, NULL);
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_MONITOR_WAITED, NULL);
+    }
+    if (exceptions.interval > 0) {
+        jvmti->SetEventNotificationMode(JVMTI_ENABLE, JVMTI_EVENT_EXCEPTION, NULL);
+    }
+
+    if (attach) {
+        // VMInit has already happened: start the writer now, then replay the current code cache
+        JNIEnv* env;
+        if (vm->GetEnv((void**) &env, JNI_VERSION_1_6) == 0) {
+            start_writer_thread(jvmti, env);
+            if (wall_clock.file != NULL) {
+                wall_clock.start(jvmti, env);
+            }
+        }
+        // Threads started before the agent was loaded will not have ThreadStart events
+        jint thread_count;
+        jthread* threads;
+        if (counters.enabled() && jvmti->GetAllThreads(&thread_count, &threads) == 0) {
+            counters.add(COUNTER_THREADS_LIVE, thread_count);
+            jvmti->Deallocate((unsigned char*) threads);
+        }
+        jvmti->GenerateEvents(JVMTI_EVENT_DYNAMIC_CODE_GENERATED);
+        jvmti->GenerateEvents(JVMTI_EVENT_COMPILED_METHOD_LOAD);
+    }
 
     return 0;
 }
 
+JNIEXPORT jint JNICALL Agent_OnLoad(JavaVM* vm, char* options, void* reserved) {
+    return init_agent(vm, options, false);
+}
+
+JNIEXPORT jint JNICALL Agent_OnAttach(JavaVM* vm, char* options, void* reserved) {
+    // Protect against repeated load
+    if (out != NULL || segments.enabled()) {
+        return 0;
+    }
+    return init_agent(vm, options, true);
+}
+
 JNIEXPORT void JNICALL Agent_OnUnload(JavaVM* vm) {
+    if (!writer_started || writer_stopped) {
+        flush_events();
+        writer.finish();
+    }
     if (out != NULL && out != stderr) {
         fclose(out);
     }
+    segments.close_all();
+    counters.close_file();
+    close_perf_files();
 }
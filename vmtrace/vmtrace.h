@@ -0,0 +1,182 @@
+/*
+ * Copyright 2019 Odnoklassniki Ltd, Mail.Ru Group
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Event definitions shared by the vmtrace agent and the binary log decoder
+
+#ifndef _VMTRACE_H
+#define _VMTRACE_H
+
+#include <stdio.h>
+#include <stddef.h>
+
+#define BINARY_LOG_MAGIC "VMTRACE"
+#define BINARY_LOG_VERSION 1
+
+enum EventKind {
+    EVENT_STRING,           // string table entry, appears only in binary log
+    EVENT_VMTRACE_STARTED,
+    EVENT_VM_START,
+    EVENT_VM_INIT,
+    EVENT_VM_DEATH,
+    EVENT_CLASS_LOAD,
+    EVENT_CLASS_PREPARE,
+    EVENT_DYNAMIC_CODE,
+    EVENT_METHOD_COMPILED,
+    EVENT_METHOD_FLUSHED,
+    EVENT_THREAD_START,
+    EVENT_THREAD_END,
+    EVENT_GC_START,
+    EVENT_GC_FINISH,
+    EVENT_LOST,
+    EVENT_REPORT,           // free-form report text, stored inline rather than in the string table
+    EVENT_LONG_GC_PAUSE,
+    EVENT_KIND_COUNT
+};
+
+#define MAX_EVENT_STRINGS 2
+#define MAX_EVENT_ARGS 2
+
+// Strings are referenced by ids of the interned string table; id 0 means null
+struct EventRecord {
+    int kind;
+    long long time;  // nanoseconds since vmtrace start
+    unsigned int strings[MAX_EVENT_STRINGS];
+    unsigned long long args[MAX_EVENT_ARGS];
+};
+
+// Number of string and integer fields stored in the binary log for each event kind
+static const unsigned char EVENT_STRING_COUNT[EVENT_KIND_COUNT] = {
+    0, 0, 0, 0, 0, 1, 1, 1, 2, 2, 1, 1, 0, 0, 0, 0, 0
+};
+static const unsigned char EVENT_ARG_COUNT[EVENT_KIND_COUNT] = {
+    0, 0, 0, 0, 0, 1, 0, 2, 2, 1, 0, 0, 0, 1, 1, 0, 1
+};
+
+typedef const char* (*StringLookup)(unsigned int id);
+
+// Renders an event in the vmtrace text log format, without the timestamp
+static inline int format_event(char* buf, size_t size, const EventRecord* e, StringLookup str) {
+    switch (e->kind) {
+        case EVENT_VMTRACE_STARTED:
+            return snprintf(buf, size, "VMTrace started");
+        case EVENT_VM_START:
+            return snprintf(buf, size, "VM started");
+        case EVENT_VM_INIT:
+            return snprintf(buf, size, "VM initialized");
+        case EVENT_VM_DEATH:
+            return snprintf(buf, size, "VM destroyed");
+        case EVENT_CLASS_LOAD:
+            return snprintf(buf, size, "Loading class: %s (%d bytes)",
+                            str(e->strings[0]), (int) e->args[0]);
+        case EVENT_CLASS_PREPARE:
+            return snprintf(buf, size, "Class prepared: %s", str(e->strings[0]));
+        case EVENT_DYNAMIC_CODE:
+            return snprintf(buf, size, "Dynamic code generated: %s (%d bytes)",
+                            str(e->strings[0]), (int) e->args[0]);
+        case EVENT_METHOD_COMPILED:
+            return snprintf(buf, size, "Method compiled: %s.%s (%d bytes)",
+                            str(e->strings[0]), str(e->strings[1]), (int) e->args[0]);
+        case EVENT_METHOD_FLUSHED:
+            return snprintf(buf, size, "Method flushed: %s.%s", str(e->strings[0]), str(e->strings[1]));
+        case EVENT_THREAD_START:
+            return snprintf(buf, size, "Thread started: %s", str(e->strings[0]));
+        case EVENT_THREAD_END:
+            return snprintf(buf, size, "Thread finished: %s", str(e->strings[0]));
+        case EVENT_GC_START:
+            return snprintf(buf, size, "GC started");
+        case EVENT_GC_FINISH:
+            return snprintf(buf, size, "GC finished");
+        case EVENT_LOST:
+            return snprintf(buf, size, "Events lost: %lld", (long long) e->args[0]);
+        case EVENT_LONG_GC_PAUSE:
+            return snprintf(buf, size, "Long GC pause: %.3f ms", e->args[0] / 1000000.0);
+        default:
+            return snprintf(buf, size, "Unknown event %d", e->kind);
+    }
+}
+
+// Binary log encoding: unsigned LEB128 varints, signed values are zigzag encoded
+
+static inline size_t put_varint(unsigned char* buf, unsigned long long value) {
+    size_t len = 0;
+    while (value >= 0x80) {
+        buf[len++] = (unsigned char) (value | 0x80);
+        value >>= 7;
+    }
+    buf[len++] = (unsigned char) value;
+    return len;
+}
+
+static inline unsigned long long zigzag_encode(long long value) {
+    return ((unsigned long long) value << 1) ^ (unsigned long long) (value >> 63);
+}
+
+static inline long long zigzag_decode(unsigned long long value) {
+    return (long long) (value >> 1) ^ -(long long) (value & 1);
+}
+
+// Counter file shared with external readers, similar to hsperfdata: a header followed by
+// named 64-bit counters. The agent updates values in place with atomic operations;
+// readers find counters by name, so new counters do not break old readers.
+
+#define COUNTERS_MAGIC "VMCOUNT"
+#define COUNTERS_DIR "/tmp/vmtrace_%s"  // user name; the default file is <dir>/<pid>.counters
+#define COUNTERS_VERSION 1
+#define COUNTER_NAME_SIZE 56
+
+enum CounterId {
+    COUNTER_CLASSES_LOADED,
+    COUNTER_CLASS_BYTES,
+    COUNTER_METHODS_COMPILED,
+    COUNTER_COMPILED_BYTES,
+    COUNTER_METHODS_FLUSHED,
+    COUNTER_GC_COUNT,
+    COUNTER_GC_TIME,
+    COUNTER_GC_MAX_PAUSE,
+    COUNTER_THREADS_STARTED,
+    COUNTER_THREADS_LIVE,
+    COUNTER_COUNT
+};
+
+static const char* const COUNTER_NAMES[COUNTER_COUNT] = {
+    "classes.loaded",
+    "classes.bytes",
+    "compiler.methods",
+    "compiler.bytes",
+    "compiler.flushed",
+    "gc.count",
+    "gc.time_ns",
+    "gc.max_pause_ns",
+    "threads.started",
+    "threads.live"
+};
+
+// One cache line per counter, so that counters updated by different threads do not share lines
+struct CounterEntry {
+    char name[COUNTER_NAME_SIZE];
+    long long value;
+};
+
+struct CounterFileHeader {
+    char magic[7];
+    char version;
+    int count;          // number of entries following the header
+    int pid;
+    long long start_time;  // ms since the epoch
+    char reserved[40];
+};
+
+#endif // _VMTRACE_H